@@ -0,0 +1,395 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <random>
+#include <codecvt>
+#include <cstdio>
+#include <sys/resource.h>
+#include <boost/program_options.hpp>
+
+#include "termgrep.hpp"
+#include "inputfile.hpp"
+
+using namespace std;
+using namespace termgrep;
+namespace po = boost::program_options;
+
+/*!
+ * \brief Synthetic workload for termgrep_bench: a term list and a corpus
+ * drawn from the same alphabet, a given share of the corpus' words being
+ * occurences of the terms.
+ */
+struct BenchSpec {
+	size_t terms = 10000;
+	size_t minLength = 3;
+	size_t maxLength = 10;
+	//! Terms have between 1 and this many words
+	size_t maxWords = 2;
+	//! Number of letters, the first 26 being ASCII ones
+	size_t alphabet = 26;
+	//! Share of the corpus' words that start an occurence of a term
+	double density = 0.01;
+	size_t corpusBytes = 64 << 20;
+	uint32_t seed = 1;
+};
+
+static const wstring LETTERS =
+	L"abcdefghijklmnopqrstuvwxyz"
+	L"àâäçéèêëîïôöùûüÿñßøåæœ"
+	L"αβγδεζηθικλμνξοπρστυφχψω"
+	L"абвгдежзийклмнопрстуфхцчшщыэюя";
+static const wstring SEPARATORS = L"    ,.;";
+
+/*!
+ * \brief Draws the workload from its own generator rather than the
+ * standard distributions, whose results differ between implementations,
+ * so that a spec always gives the same terms and corpus.
+ */
+class Generator {
+public:
+	Generator(const BenchSpec &spec) : spec(spec), rng(spec.seed) {}
+
+	vector<wstring> makeTerms() {
+		vector<wstring> terms(spec.terms);
+		for (auto &term : terms) {
+			size_t words = 1 + below(spec.maxWords);
+			for (size_t i = 0; i < words; i ++) {
+				if (i > 0)
+					term += L' ';
+				term += makeWord();
+			}
+		}
+		return terms;
+	}
+
+	wstring makeCorpus(const vector<wstring> &terms) {
+		wstring corpus;
+		// Reserved by characters, which are at least one byte each
+		corpus.reserve(spec.corpusBytes);
+		size_t bytes = 0;
+		while (bytes < spec.corpusBytes) {
+			const size_t start = corpus.size();
+			if (!terms.empty() && unit() < spec.density)
+				corpus += terms[below(terms.size())];
+			else
+				corpus += makeWord();
+			corpus += SEPARATORS[below(SEPARATORS.size())];
+			for (size_t i = start; i < corpus.size(); i ++)
+				bytes += corpus[i] < 0x80 ? 1 : corpus[i] < 0x800 ? 2 : 3;
+		}
+		return corpus;
+	}
+private:
+	const BenchSpec &spec;
+	mt19937 rng;
+
+	size_t below(size_t n) { return rng() % n; }
+	double unit() { return rng() / 4294967296.0; }
+	wstring makeWord() {
+		size_t length = spec.minLength + below(spec.maxLength - spec.minLength + 1);
+		wstring word(length, L' ');
+		for (auto &chr : word)
+			chr = LETTERS[below(spec.alphabet)];
+		return word;
+	}
+};
+
+static string toUTF8(const wstring &str) {
+	return wstring_convert<codecvt_utf8<wchar_t>>().to_bytes(str);
+}
+
+template<class CharType>
+basic_string<CharType> encode(const wstring &str);
+
+template<> string encode<char>(const wstring &str) { return toUTF8(str); }
+template<> wstring encode<wchar_t>(const wstring &str) { return str; }
+
+static double since(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static size_t maxRSS() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (size_t) usage.ru_maxrss << 10;
+}
+
+struct RunOptions {
+	bool wholeWords = true;
+	bool utf8 = false;
+	size_t threads = 1;
+	size_t repeat = 3;
+	string file;
+	//! Cache size of the lazy matcher, 0 for the eager one
+	size_t lazyBytes = 0;
+	MatcherEngine engine = MatcherEngine::POWERSET;
+	bool prefilter = true;
+};
+
+/*!
+ * \brief Feeds the file to 'matcher' like termgrep_main does: narrow
+ * matchers get the raw bytes, wide ones go through a UTF-8 wifstream.
+ */
+template<class CharType>
+void scanFile(const string &path, typename TermGrep<CharType>::Matcher &matcher);
+
+template<>
+void scanFile<char>(const string &path, TermGrep<char>::Matcher &matcher) {
+	InputFile input(path);
+	if (!input.read([&](const char *data, size_t n) { matcher.feed(data, n); }))
+		throw runtime_error("Can't read "+ path);
+}
+
+template<>
+void scanFile<wchar_t>(const string &path, TermGrep<wchar_t>::Matcher &matcher) {
+	wifstream fin(path);
+	fin.imbue(locale(fin.getloc(), new codecvt_utf8<wchar_t>));
+	fin >> matcher;
+}
+
+/*!
+ * \brief Reports the best of 'repeat' runs of 'scan', as MB/s of the
+ * corpus' UTF-8 encoding so that all character types compare.
+ */
+template<class Scan>
+void reportScan(const char *name, size_t bytes, size_t chars, size_t repeat,
+		Scan scan) {
+	double best = 0;
+	size_t matches = 0;
+	for (size_t i = 0; i < repeat; i ++) {
+		auto start = chrono::steady_clock::now();
+		matches = scan();
+		double seconds = since(start);
+		if (i == 0 || seconds < best)
+			best = seconds;
+	}
+	printf("%-12s %8.3f s %10.1f MB/s %10.1f Mchar/s %12zu matches\n", name,
+		best, bytes / best / 1e6, chars / best / 1e6, matches);
+}
+
+template<class CharType>
+void run(const BenchSpec &spec, const RunOptions &opts) {
+	Generator gen(spec);
+	auto start = chrono::steady_clock::now();
+	const vector<wstring> wterms = gen.makeTerms();
+	const wstring wcorpus = gen.makeCorpus(wterms);
+	const string corpus8 = toUTF8(wcorpus);
+	const basic_string<CharType> corpus = encode<CharType>(wcorpus);
+	printf("Generated %zu terms and %zu characters (%zu bytes) in %.3f s\n",
+		wterms.size(), wcorpus.size(), corpus8.size(), since(start));
+
+	TermGrep<CharType> grep(opts.wholeWords, opts.utf8);
+	for (auto &term : wterms)
+		grep.addTerm(encode<CharType>(term));
+	start = chrono::steady_clock::now();
+	auto matcher = opts.lazyBytes ? grep.makeLazyChecker(opts.lazyBytes) :
+		grep.makeChecker(opts.engine);
+	const double buildSeconds = since(start);
+	auto &stats = matcher->getBuildStats();
+	printf("Built in %.3f s (compilation %.3f s): %zu states, %zu edges, "
+		"minimized to %zu states, %zu edges, peak ~%zu MiB, max RSS %zu MiB\n",
+		buildSeconds, stats.seconds, stats.states, stats.edges,
+		stats.minimizedStates, stats.minimizedEdges, stats.peakBytes >> 20,
+		maxRSS() >> 20);
+	matcher->setKeepMatches(false);
+	matcher->setPrefilter(opts.prefilter);
+	printf("Prefilter: %s\n", matcher->getPrefilterName() ?
+		matcher->getPrefilterName() : "none");
+
+	auto total = [&]() {
+		size_t matches = 0;
+		for (uint32_t termid : matcher->getCounts().touched)
+			matches += matcher->getCounts().counts[termid];
+		return matches;
+	};
+	const size_t bytes = corpus8.size(), chars = wcorpus.size();
+	reportScan("memory", bytes, chars, opts.repeat, [&]() {
+		matcher->reset();
+		matcher->feed(corpus.data(), corpus.size());
+		matcher->end();
+		return total();
+	});
+	if (opts.threads > 1)
+		reportScan("memory split", bytes, chars, opts.repeat, [&]() {
+			matcher->reset();
+			matcher->feedParallel(corpus.data(), corpus.size(), opts.threads);
+			matcher->end();
+			return total();
+		});
+	if (!opts.file.empty()) {
+		ofstream(opts.file, ios::binary) << corpus8;
+		reportScan("file", bytes, chars, opts.repeat, [&]() {
+			matcher->reset();
+			scanFile<CharType>(opts.file, *matcher);
+			matcher->end();
+			return total();
+		});
+		remove(opts.file.c_str());
+	}
+	printf("Table%s: %zu MiB\n", opts.lazyBytes ? " and lazy cache" : "",
+		matcher->getTableBytes() >> 20);
+}
+
+/*!
+ * \brief Checks that TermGrep::updateChecker() finds what rebuilding the
+ * matcher does: half the terms are compiled, then each round adds a few
+ * of the others and removes a few, and the updated matcher must count
+ * the same occurences of each term in the corpus as one built from
+ * scratch. Returns the number of rounds that didn't.
+ */
+template<class CharType>
+size_t checkUpdates(const BenchSpec &spec, const RunOptions &opts, size_t rounds) {
+	Generator gen(spec);
+	const vector<wstring> wterms = gen.makeTerms();
+	const basic_string<CharType> corpus = encode<CharType>(gen.makeCorpus(wterms));
+	TermGrep<CharType> grep(opts.wholeWords, opts.utf8);
+	size_t added = wterms.size() / 2;
+	for (size_t i = 0; i < added; i ++)
+		grep.addTerm(encode<CharType>(wterms[i]));
+	auto build = [&]() {
+		auto matcher = opts.lazyBytes ? grep.makeLazyChecker(opts.lazyBytes) :
+			grep.makeChecker(opts.engine);
+		matcher->setKeepMatches(false);
+		return matcher;
+	};
+	auto counts = [&](typename TermGrep<CharType>::Matcher &matcher) {
+		matcher.reset();
+		matcher.feed(corpus.data(), corpus.size());
+		matcher.end();
+		return matcher.getCounts().counts;
+	};
+	auto matcher = build();
+	mt19937 rng(spec.seed);
+	size_t failures = 0;
+	for (size_t round = 1; round <= rounds && added < wterms.size(); round ++) {
+		for (size_t n = 1 + rng() % 3; n > 0 && added < wterms.size(); n --)
+			grep.addTerm(encode<CharType>(wterms[added ++]));
+		for (size_t n = rng() % 3; n > 0; n --)
+			grep.removeTerm(1 + rng() % (grep.getTerms().size() - 1));
+		grep.updateChecker(*matcher);
+		auto rebuilt = build();
+		const auto expected = counts(*rebuilt), found = counts(*matcher);
+		size_t differ = 0;
+		for (size_t termid = 0; termid < expected.size(); termid ++)
+			differ += expected[termid] != found[termid];
+		if (differ != 0) {
+			printf("Round %zu: %zu terms counted differently than by a rebuilt "
+				"matcher\n", round, differ);
+			failures ++;
+		}
+	}
+	printf("Checked %zu terms after updates: %zu failed rounds\n",
+		grep.getTerms().size() - 1, failures);
+	return failures;
+}
+
+int main(int argc, char **argv) {
+	BenchSpec spec;
+	RunOptions opts;
+	po::options_description desc("Options");
+	desc.add_options()
+		("help", "Print this help message")
+		("terms", po::value<size_t>(&spec.terms)->default_value(spec.terms),
+			"Number of terms")
+		("min-length", po::value<size_t>(&spec.minLength)->default_value(spec.minLength),
+			"Minimum word length")
+		("max-length", po::value<size_t>(&spec.maxLength)->default_value(spec.maxLength),
+			"Maximum word length")
+		("max-words", po::value<size_t>(&spec.maxWords)->default_value(spec.maxWords),
+			"Maximum number of words per term")
+		("alphabet", po::value<size_t>(&spec.alphabet)->default_value(spec.alphabet),
+			"Number of letters, non-ASCII ones after the first 26")
+		("density", po::value<double>(&spec.density)->default_value(spec.density),
+			"Share of the corpus words that are occurences of terms")
+		("corpus-mb", po::value<size_t>()->default_value(spec.corpusBytes >> 20),
+			"Size of the corpus, in MB of UTF-8")
+		("seed", po::value<uint32_t>(&spec.seed)->default_value(spec.seed),
+			"Seed of the generator")
+		("wide", po::bool_switch(), "Benchmark the wchar_t matcher")
+		("utf8", po::bool_switch(&opts.utf8), "Use the UTF-8 mode of the char matcher")
+		("no-whole-words", po::bool_switch(), "Don't require whole words")
+		("threads", po::value<size_t>(&opts.threads)->default_value(opts.threads),
+			"Also time feedParallel() with this many threads")
+		("repeat", po::value<size_t>(&opts.repeat)->default_value(opts.repeat),
+			"Scan this many times and report the fastest")
+		("file", po::value<string>(&opts.file),
+			"Also time scanning the corpus from this file, created and "
+			"removed by the benchmark")
+		("lazy", po::value<size_t>(), "Benchmark the lazy matcher, with a "
+			"cache of this many MiB")
+		("engine", po::value<string>()->default_value("powerset"),
+			"Matcher to benchmark: powerset, aho-corasick or aho-corasick-dfa")
+		("no-prefilter", po::bool_switch(), "Step every character through "
+			"the matcher, even where no term can start")
+		("check-updates", po::value<size_t>(), "Instead of timing anything, "
+			"update a matcher this many times and check that it counts "
+			"what a rebuilt one does");
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch (exception const &ex) {
+		cerr << "Error : "<< ex.what() << endl
+			<< desc << endl;
+		return 1;
+	}
+	if (vm.count("help")) {
+		cout << desc << endl;
+		return 0;
+	}
+	spec.corpusBytes = vm["corpus-mb"].as<size_t>() << 20;
+	opts.wholeWords = !vm["no-whole-words"].as<bool>();
+	opts.prefilter = !vm["no-prefilter"].as<bool>();
+	if (vm.count("lazy"))
+		opts.lazyBytes = vm["lazy"].as<size_t>() << 20;
+	const string engine = vm["engine"].as<string>();
+	if (engine == "aho-corasick")
+		opts.engine = MatcherEngine::AHO_CORASICK;
+	else if (engine == "aho-corasick-dfa")
+		opts.engine = MatcherEngine::AHO_CORASICK_DFA;
+	else if (engine != "powerset") {
+		cerr << "Error : unknown engine "<< engine << endl;
+		return 1;
+	}
+	const bool wide = vm["wide"].as<bool>();
+	if (spec.minLength == 0 || spec.maxLength < spec.minLength || spec.maxWords == 0
+			|| spec.alphabet == 0 || spec.alphabet > LETTERS.size()
+			|| opts.repeat == 0) {
+		cerr << "Error : invalid workload" << endl << desc << endl;
+		return 1;
+	}
+	if (spec.alphabet > 26 && !wide && !opts.utf8) {
+		cerr << "Error : non-ASCII letters need --wide or --utf8" << endl;
+		return 1;
+	}
+	if (opts.lazyBytes && opts.engine != MatcherEngine::POWERSET) {
+		cerr << "Error : --lazy is only for the powerset engine" << endl;
+		return 1;
+	}
+	if (wide && opts.utf8) {
+		cerr << "Error : --utf8 is only for the char matcher" << endl;
+		return 1;
+	}
+
+	printf("termgrep_bench: %s %s matcher%s, %zu terms of %zu-%zu words of "
+		"%zu-%zu letters out of %zu, density %g, seed %u\n",
+		engine.c_str(), wide ? "wchar_t" : "char", opts.utf8 ? " (UTF-8)" : "", spec.terms,
+		(size_t) 1, spec.maxWords, spec.minLength, spec.maxLength,
+		spec.alphabet, spec.density, spec.seed);
+	try {
+		if (vm.count("check-updates")) {
+			const size_t rounds = vm["check-updates"].as<size_t>();
+			return (wide ? checkUpdates<wchar_t>(spec, opts, rounds) :
+				checkUpdates<char>(spec, opts, rounds)) == 0 ? 0 : 1;
+		}
+		if (wide)
+			run<wchar_t>(spec, opts);
+		else
+			run<char>(spec, opts);
+	} catch (runtime_error const &ex) {
+		cerr << "Error : "<< ex.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <functional>
+
+#ifdef TERMGREP_ZLIB
+#include <zlib.h>
+#endif
+#ifdef TERMGREP_ZSTD
+#include <zstd.h>
+#endif
+
+namespace termgrep {
+
+    /*!
+     * \brief Sits between a reader and the consumer of its blocks, and
+     * decompresses the data on the fly if it starts like a gzip or zstd
+     * stream. Anything else is passed through as is. Decompressed data is
+     * handed out in blocks of 'blockSize' bytes, so that the whole file is
+     * never held in memory.
+     *
+     * Each format is only available if termgrep was built with its library
+     * (TERMGREP_ZLIB, TERMGREP_ZSTD); inputs in a missing format are an
+     * error rather than scanned compressed.
+     */
+    class Decompressor {
+    public:
+        typedef std::function<void(const char *, size_t)> Consumer;
+
+        Decompressor(Consumer consume, size_t blockSize) :
+            consume(consume), blockSize(blockSize) {}
+        Decompressor(const Decompressor &) = delete;
+        Decompressor &operator=(const Decompressor &) = delete;
+        ~Decompressor() { release(); }
+
+        //! Feeds the next block of the input
+        void operator()(const char *data, size_t size) {
+            if (format == UNKNOWN) {
+                // Not enough bytes yet to tell, which only happens on pipes
+                if (head.size() + size < MAGIC_SIZE) {
+                    head.append(data, size);
+                    return;
+                }
+                if (!head.empty()) {
+                    head.append(data, size);
+                    detect(head.data());
+                    data = head.data();
+                    size = head.size();
+                } else
+                    detect(data);
+            }
+            if (!err.empty())
+                return;
+            switch (format) {
+            case GZIP: inflate(data, size); break;
+            case ZSTD: decompress(data, size); break;
+            default: consume(data, size);
+            }
+            head.clear();
+        }
+
+        /*!
+         * \brief Must be called at the end of the input. Returns false if
+         * it couldn't be decompressed, see error().
+         */
+        bool finish() {
+            if (format == UNKNOWN && !head.empty() && err.empty())
+                consume(head.data(), head.size());
+            else if (err.empty() && !ended)
+                err = "truncated compressed input";
+            release();
+            return err.empty();
+        }
+
+        const std::string &error() const { return err; }
+    private:
+        enum Format { UNKNOWN, PLAIN, GZIP, ZSTD };
+        static const size_t MAGIC_SIZE = 4;
+
+        Consumer consume;
+        const size_t blockSize;
+        Format format = UNKNOWN;
+        std::string head;
+        std::vector<char> out;
+        // Whether the compressed stream is complete, so far
+        bool ended = true;
+        std::string err;
+#ifdef TERMGREP_ZLIB
+        std::unique_ptr<z_stream> zs;
+#endif
+#ifdef TERMGREP_ZSTD
+        ZSTD_DStream *zds = nullptr;
+#endif
+
+        void detect(const char *magic) {
+            const unsigned char *bytes = (const unsigned char *) magic;
+            if (bytes[0] == 0x1F && bytes[1] == 0x8B) {
+                format = GZIP;
+#ifdef TERMGREP_ZLIB
+                zs.reset(new z_stream());
+                // 16 + MAX_WBITS only accepts gzip headers
+                if (inflateInit2(zs.get(), 16 + MAX_WBITS) != Z_OK) {
+                    zs.reset();
+                    err = "can't initialize zlib";
+                }
+#else
+                err = "gzip input, but termgrep was built without zlib";
+#endif
+            } else if (bytes[0] == 0x28 && bytes[1] == 0xB5 &&
+                    bytes[2] == 0x2F && bytes[3] == 0xFD) {
+                format = ZSTD;
+#ifdef TERMGREP_ZSTD
+                zds = ZSTD_createDStream();
+                if (zds == nullptr || ZSTD_isError(ZSTD_initDStream(zds)))
+                    err = "can't initialize zstd";
+#else
+                err = "zstd input, but termgrep was built without zstd";
+#endif
+            } else
+                format = PLAIN;
+            if (format != PLAIN) {
+                out.resize(blockSize);
+                ended = false;
+            }
+        }
+
+        void inflate(const char *data, size_t size) {
+#ifdef TERMGREP_ZLIB
+            z_stream &z = *zs;
+            z.next_in = (Bytef *) data;
+            z.avail_in = size;
+            while (z.avail_in > 0 || !ended) {
+                z.next_out = (Bytef *) out.data();
+                z.avail_out = out.size();
+                int ret = ::inflate(&z, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    err = std::string("gzip: ") + (z.msg ? z.msg : "corrupt input");
+                    return;
+                }
+                size_t produced = out.size() - z.avail_out;
+                if (produced > 0)
+                    consume(out.data(), produced);
+                ended = ret == Z_STREAM_END;
+                // Concatenated members, as written by 'cat a.gz b.gz'
+                if (ended && z.avail_in > 0)
+                    inflateReset(&z);
+                else if (produced == 0)
+                    break; // Needs more input
+            }
+#endif
+        }
+
+        void decompress(const char *data, size_t size) {
+#ifdef TERMGREP_ZSTD
+            ZSTD_inBuffer in = {data, size, 0};
+            while (true) {
+                ZSTD_outBuffer output = {out.data(), out.size(), 0};
+                size_t ret = ZSTD_decompressStream(zds, &output, &in);
+                if (ZSTD_isError(ret)) {
+                    err = std::string("zstd: ") + ZSTD_getErrorName(ret);
+                    return;
+                }
+                if (output.pos > 0)
+                    consume(out.data(), output.pos);
+                // 0 once a frame is complete and flushed
+                ended = ret == 0;
+                if (in.pos == in.size && output.pos < output.size)
+                    break;
+            }
+#endif
+        }
+
+        void release() {
+#ifdef TERMGREP_ZLIB
+            if (zs) {
+                inflateEnd(zs.get());
+                zs.reset();
+            }
+#endif
+#ifdef TERMGREP_ZSTD
+            if (zds != nullptr) {
+                ZSTD_freeDStream(zds);
+                zds = nullptr;
+            }
+#endif
+        }
+    };
+}
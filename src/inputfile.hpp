@@ -0,0 +1,263 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace termgrep {
+
+    /*!
+     * \brief Raw, copy-free access to the bytes of an input file.
+     * Regular files are memory-mapped and handed out straight from the page
+     * cache; anything that can't be mapped (pipes, terminals, stdin...) is
+     * read() in large blocks instead.
+     */
+    class InputFile {
+    public:
+        static const size_t DEFAULT_BLOCK = 1 << 20;
+
+        InputFile(const std::string &path) : owned(true) {
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                err = errno;
+        }
+        //! Wraps an already open descriptor, which is left open afterwards
+        explicit InputFile(int fd) : fd(fd), owned(false) {}
+        InputFile(const InputFile &) = delete;
+        InputFile &operator=(const InputFile &) = delete;
+        ~InputFile() {
+            if (owned && fd >= 0)
+                ::close(fd);
+        }
+
+        bool good() const { return err == 0; }
+        //! errno value of the last failure, 0 if none
+        int error() const { return err; }
+
+        /*!
+         * \brief Calls consume(const char *data, size_t size) on successive
+         * blocks of at most 'blockSize' bytes, until the end of the file.
+         * Returns false (see error()) if the file couldn't be read.
+         */
+        template<class Consumer>
+        bool read(Consumer consume, size_t blockSize = DEFAULT_BLOCK) {
+            if (!good())
+                return false;
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                size_t size = st.st_size;
+                if (size == 0)
+                    return true;
+                void *map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map != MAP_FAILED) {
+                    ::madvise(map, size, MADV_SEQUENTIAL);
+                    const char *data = static_cast<const char *>(map);
+                    for (size_t off = 0; off < size; off += blockSize)
+                        consume(data + off, std::min(blockSize, size - off));
+                    ::munmap(map, size);
+                    return true;
+                }
+            }
+            std::vector<char> buf(blockSize);
+            while (true) {
+                ssize_t got = ::read(fd, buf.data(), buf.size());
+                if (got < 0 && errno == EINTR)
+                    continue;
+                if (got < 0) {
+                    err = errno;
+                    return false;
+                }
+                if (got == 0)
+                    return true;
+                consume(buf.data(), (size_t) got);
+            }
+        }
+
+        /*!
+         * \brief Reads up to 'size' bytes into 'buf', only stopping short
+         * at the end of the file. Returns the number of bytes read, or -1
+         * (see error()) if the file couldn't be read.
+         */
+        ssize_t readBlock(char *buf, size_t size) {
+            if (!good())
+                return -1;
+            size_t total = 0;
+            while (total < size) {
+                ssize_t got = ::read(fd, buf + total, size - total);
+                if (got < 0 && errno == EINTR)
+                    continue;
+                if (got < 0) {
+                    err = errno;
+                    return -1;
+                }
+                if (got == 0)
+                    break;
+                total += got;
+            }
+            return total;
+        }
+    private:
+        int fd;
+        bool owned;
+        int err = 0;
+    };
+
+    /*!
+     * \brief Reads a list of files ahead of their scan, on dedicated I/O
+     * threads, so that the scan doesn't wait for slow storage. Files are
+     * read in order into blocks that are handed to whoever claimed the
+     * file, one or several consumers.
+     *
+     * Each I/O thread reads one file at a time and may hold at most
+     * budget / ioThreads bytes of blocks not consumed yet, so memory stays
+     * bounded whatever the size of the files. Since files are claimed and
+     * read in the same order, the oldest file not consumed yet always has
+     * room to progress: a consumer never waits on blocks held for later
+     * files.
+     */
+    class ReadAhead {
+    public:
+        ReadAhead(const std::vector<std::string> &paths, size_t budget,
+                size_t ioThreads, size_t blockSize = InputFile::DEFAULT_BLOCK) :
+                paths(paths), blockSize(blockSize),
+                quota(std::max(budget / std::max<size_t>(ioThreads, 1), blockSize)) {
+            for (size_t i = 0; i < paths.size(); i ++)
+                files.emplace_back(new File());
+            held.assign(std::max<size_t>(ioThreads, 1), 0);
+            for (size_t i = 0; i < held.size(); i ++)
+                threads.emplace_back(&ReadAhead::readFiles, this, i);
+        }
+        ReadAhead(const ReadAhead &) = delete;
+        ReadAhead &operator=(const ReadAhead &) = delete;
+        ~ReadAhead() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopped = true;
+            }
+            room.notify_all();
+            for (auto &th : threads)
+                th.join();
+        }
+
+        //! Claims the next file, in order. Returns false once all are.
+        bool next(size_t &index) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (claimed == paths.size())
+                return false;
+            index = claimed ++;
+            return true;
+        }
+
+        /*!
+         * \brief Calls consume(const char *data, size_t size) on the blocks
+         * of the claimed file 'index', as they are read. Returns false (see
+         * error()) if the file couldn't be read.
+         */
+        template<class Consumer>
+        bool read(size_t index, Consumer consume) {
+            File &file = *files[index];
+            while (true) {
+                Block block;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    file.ready.wait(guard, [&]() {
+                        return !file.blocks.empty() || file.done;
+                    });
+                    if (file.blocks.empty())
+                        return file.err == 0;
+                    block = std::move(file.blocks.front());
+                    file.blocks.pop_front();
+                }
+                consume(block.data.get(), block.size);
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    held[file.reader] -= blockSize;
+                    spare.push_back(std::move(block.data));
+                }
+                room.notify_all();
+            }
+        }
+
+        //! errno value of the failure to read file 'index', 0 if none
+        int error(size_t index) const { return files[index]->err; }
+    private:
+        struct Block {
+            std::unique_ptr<char[]> data;
+            size_t size = 0;
+        };
+        struct File {
+            std::deque<Block> blocks;
+            std::condition_variable ready;
+            size_t reader = 0;
+            bool done = false;
+            int err = 0;
+        };
+
+        const std::vector<std::string> paths;
+        const size_t blockSize, quota;
+        std::vector<std::unique_ptr<File>> files;
+        // Bytes of blocks each I/O thread has read and that aren't consumed
+        std::vector<size_t> held;
+        // Buffers of consumed blocks, for the next ones
+        std::vector<std::unique_ptr<char[]>> spare;
+        std::vector<std::thread> threads;
+        std::mutex lock;
+        std::condition_variable room;
+        size_t claimed = 0, started = 0;
+        bool stopped = false;
+
+        void readFiles(size_t reader) {
+            while (true) {
+                size_t index;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (stopped || started == paths.size())
+                        return;
+                    index = started ++;
+                }
+                File &file = *files[index];
+                file.reader = reader;
+                InputFile input(paths[index]);
+                while (true) {
+                    Block block;
+                    {
+                        std::unique_lock<std::mutex> guard(lock);
+                        room.wait(guard, [&]() {
+                            return stopped || held[reader] + blockSize <= quota;
+                        });
+                        if (stopped)
+                            return;
+                        held[reader] += blockSize;
+                        if (!spare.empty()) {
+                            block.data = std::move(spare.back());
+                            spare.pop_back();
+                        }
+                    }
+                    if (!block.data)
+                        block.data.reset(new char[blockSize]);
+                    ssize_t got = input.readBlock(block.data.get(), blockSize);
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (got <= 0) {
+                        held[reader] -= blockSize;
+                        spare.push_back(std::move(block.data));
+                        file.err = input.error();
+                        file.done = true;
+                        file.ready.notify_all();
+                        break;
+                    }
+                    block.size = got;
+                    file.blocks.push_back(std::move(block));
+                    file.ready.notify_all();
+                }
+            }
+        }
+    };
+}
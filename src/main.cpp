@@ -1,6 +1,11 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <sys/resource.h>
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
 
@@ -9,6 +14,10 @@
 #define CTYPENAME STR(DEFAULT_CTYPE)
 #endif
 #include "outputformats.hpp"
+#include "workqueue.hpp"
+#include "inputfile.hpp"
+#include "decompress.hpp"
+#include "server.hpp"
 
 using namespace std;
 using namespace termgrep;
@@ -49,37 +58,535 @@ pair<string,string> getFileIdentifier(string input, string separator) {
 	return make_pair(input, input);
 }
 
+MatcherEngine getEngineByName(const string &name) {
+	if (boost::iequals(name, "powerset"))
+		return MatcherEngine::POWERSET;
+	if (boost::iequals(name, "aho-corasick"))
+		return MatcherEngine::AHO_CORASICK;
+	if (boost::iequals(name, "aho-corasick-dfa"))
+		return MatcherEngine::AHO_CORASICK_DFA;
+	throw runtime_error("Unknown engine: "+ name);
+}
+
 template<class CharType>
-void readTermsFrom(TermGrep<CharType> &grep, basic_istream<CharType> &infile) {
+void readTermsFrom(vector<basic_string<CharType>> &terms, basic_istream<CharType> &infile) {
 	basic_string<CharType> line;
 	while (infile) {
 		getline(infile, line);
 		boost::trim(line);
 		if (line.length() > 0)
-			grep.addTerm(line);
+			terms.push_back(line);
 	}
-	cerr << "Successfully read "<< grep.getTerms().size() << " terms" << endl;
 }
 
 template<class CharType>
-void readTermsFrom(TermGrep<CharType> &grep, string infname) {
+void readTermsFrom(vector<basic_string<CharType>> &terms, string infname) {
 	basic_ifstream<CharType> infile(infname);
-	readTermsFrom(grep, infile);
+	readTermsFrom(terms, infile);
 	infile.close();
 }
 
+struct ScanOptions {
+	size_t threads = 1;
+	// When non-zero, each input is split in chunks of this many characters
+	// which are spread over the threads, instead of one file per thread
+	size_t splitSize = 0;
+	// When non-zero, files are read ahead by 'ioThreads' threads, holding
+	// at most this many bytes that aren't scanned yet
+	size_t readAhead = 0;
+	size_t ioThreads = 2;
+};
+
+// The feed functions add the number of characters read to 'scanned'
+
 template<class CharType>
-bool feedTo(const string &fname, typename TermGrep<CharType>::Matcher &matcher) {
+void feedFrom(basic_istream<CharType> &is,
+		typename TermGrep<CharType>::Matcher &matcher, const ScanOptions &opts,
+		size_t &scanned) {
+	const bool split = opts.splitSize != 0 && opts.threads > 1;
+	vector<CharType> buf(split ? opts.splitSize * opts.threads : 1 << 16);
+	while (is) {
+		is.read(buf.data(), buf.size());
+		if (split)
+			matcher.feedParallel(buf.data(), is.gcount(), opts.threads);
+		else
+			matcher.feed(buf.data(), is.gcount());
+		scanned += is.gcount();
+	}
+}
+
+template<class CharType>
+bool feedTo(const string &fname, typename TermGrep<CharType>::Matcher &matcher,
+		const ScanOptions &opts, size_t &scanned) {
 	auto fin = basic_ifstream<CharType>(fname);
 	if (!fin) {
 		cerr << "Can't read file "<< fname <<" :" << endl
 			<< "\t" << strerror(errno) << endl;
 		return false;
 	}
-	fin >> matcher;
+	feedFrom(fin, matcher, opts, scanned);
+	return true;
+}
+
+// Size of the blocks of raw bytes, which are split between the threads
+// with --split-size
+size_t rawBlockSize(const ScanOptions &opts) {
+	if (opts.splitSize == 0 || opts.threads <= 1)
+		return InputFile::DEFAULT_BLOCK;
+	return opts.splitSize * opts.threads;
+}
+
+function<void(const char *, size_t)> rawFeeder(TermGrep<char>::Matcher &matcher,
+		const ScanOptions &opts, size_t &scanned) {
+	if (opts.splitSize == 0 || opts.threads <= 1)
+		return [&](const char *data, size_t n) {
+			matcher.feed(data, n);
+			scanned += n;
+		};
+	return [&](const char *data, size_t n) {
+		matcher.feedParallel(data, n, opts.threads);
+		scanned += n;
+	};
+}
+
+/*!
+ * \brief Feeds raw bytes to a narrow matcher, decompressing them on the way
+ * if they are gzip or zstd data. 'read' passes the input's blocks to its
+ * argument, and returns false if it couldn't, 'readError' then giving the
+ * errno value. 'name' is only for error messages.
+ */
+template<class Reader, class ReadError>
+bool feedRaw(Reader read, ReadError readError, const string &name,
+		TermGrep<char>::Matcher &matcher, const ScanOptions &opts,
+		size_t &scanned) {
+	Decompressor decompress(rawFeeder(matcher, opts, scanned), rawBlockSize(opts));
+	if (!read([&](const char *data, size_t n) { decompress(data, n); })) {
+		cerr << "Can't read "<< name <<" :" << endl
+			<< "\t" << strerror(readError()) << endl;
+		return false;
+	}
+	if (!decompress.finish()) {
+		cerr << "Can't decompress "<< name <<" :" << endl
+			<< "\t" << decompress.error() << endl;
+		return false;
+	}
+	return true;
+}
+
+/*!
+ * \brief Feeds the bytes of 'input' to a narrow matcher, straight from the
+ * page cache when the file can be mapped, bypassing iostreams.
+ */
+bool feedRaw(InputFile &input, const string &name,
+		TermGrep<char>::Matcher &matcher, const ScanOptions &opts,
+		size_t &scanned) {
+	return feedRaw([&](Decompressor::Consumer consume) {
+		return input.read(consume, rawBlockSize(opts));
+	}, [&]() { return input.error(); }, name, matcher, opts, scanned);
+}
+
+//! Feeds the file 'index' of 'readAhead' to a matcher, narrow ones only
+template<class CharType>
+bool feedAhead(ReadAhead &readAhead, size_t index, const string &fname,
+		typename TermGrep<CharType>::Matcher &matcher, const ScanOptions &opts,
+		size_t &scanned) {
+	throw runtime_error("Read-ahead is only supported by termgrep_main");
+}
+
+template<>
+bool feedAhead<char>(ReadAhead &readAhead, size_t index, const string &fname,
+		TermGrep<char>::Matcher &matcher, const ScanOptions &opts,
+		size_t &scanned) {
+	return feedRaw([&](Decompressor::Consumer consume) {
+		return readAhead.read(index, consume);
+	}, [&]() { return readAhead.error(index); }, "file "+ fname,
+		matcher, opts, scanned);
+}
+
+template<>
+bool feedTo<char>(const string &fname, TermGrep<char>::Matcher &matcher,
+		const ScanOptions &opts, size_t &scanned) {
+	InputFile input(fname);
+	return feedRaw(input, "file "+ fname, matcher, opts, scanned);
+}
+
+template<class CharType>
+void feedStdin(typename TermGrep<CharType>::Matcher &matcher,
+		const ScanOptions &opts, size_t &scanned) {
+	feedFrom(in<CharType>(), matcher, opts, scanned);
+}
+
+template<>
+void feedStdin<char>(TermGrep<char>::Matcher &matcher, const ScanOptions &opts,
+		size_t &scanned) {
+	InputFile input(STDIN_FILENO);
+	feedRaw(input, "standard input", matcher, opts, scanned);
+}
+
+/*!
+ * \brief Keeps the matches of a file scanned before its turn to be written:
+ * in memory up to MEMORY_SPANS of them, then in a temporary file, so that a
+ * file with many matches waiting for the files before it doesn't hold them
+ * all in memory. clear() keeps both for the next file.
+ */
+class SpanSpill : public MatchSink {
+public:
+	static const size_t MEMORY_SPANS = 1 << 16;
+
+	~SpanSpill() {
+		if (file)
+			fclose(file);
+	}
+	void match(size_t termid, size_t startPos, size_t endPos) override {
+		if (spans.size() >= MEMORY_SPANS && !memoryOnly)
+			spill();
+		spans.push_back(MatchSpan{termid, startPos, endPos});
+	}
+	//! Passes the matches kept to 'sink', in order
+	void replay(MatchSink &sink) {
+		if (spilled != 0 && fseek(file, 0, SEEK_SET) == 0) {
+			vector<MatchSpan> chunk(MEMORY_SPANS);
+			size_t left = spilled, n;
+			while (left > 0 && (n = fread(chunk.data(), sizeof(MatchSpan),
+					min(left, MEMORY_SPANS), file)) > 0) {
+				for (size_t i = 0; i < n; i ++)
+					sink.match(chunk[i].termid, chunk[i].startPos, chunk[i].endPos);
+				left -= n;
+			}
+			if (left > 0)
+				cerr << "Lost " << left << " matches in their temporary file" << endl;
+		}
+		for (auto &span : spans)
+			sink.match(span.termid, span.startPos, span.endPos);
+	}
+	void clear() {
+		spans.clear();
+		spilled = 0;
+	}
+private:
+	vector<MatchSpan> spans;
+	FILE *file = nullptr;
+	// Matches in the file, before those in memory
+	size_t spilled = 0;
+	// Set when the file can't be written, the matches then stay in memory
+	bool memoryOnly = false;
+
+	void spill() {
+		if (!file)
+			file = tmpfile();
+		if (file && fseek(file, spilled * sizeof(MatchSpan), SEEK_SET) == 0 &&
+				fwrite(spans.data(), sizeof(MatchSpan), spans.size(), file) == spans.size()) {
+			spilled += spans.size();
+			spans.clear();
+		} else
+			memoryOnly = true;
+	}
+};
+
+struct FileResult {
+	string fileid;
+	bool read = false;
+	vector<pair<uint32_t, uint32_t>> occurences;
+	// Only for outputs that need them, see OutputFormat::needsSpans(), when
+	// the file isn't written as it is scanned
+	unique_ptr<SpanSpill> spans;
+	size_t scanned = 0;
+	double seconds = 0;
+};
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/*!
+ * \brief Per-file figures of a scan, reported by --stats: latencies are
+ * counted in buckets of powers of two milliseconds, and the slowest files
+ * are kept to spot pathological documents.
+ */
+struct ScanStats {
+	static const size_t BUCKETS = 24, SLOWEST = 10;
+	size_t files = 0, failed = 0, scanned = 0, matches = 0;
+	double seconds = 0;
+	vector<size_t> latency = vector<size_t>(BUCKETS, 0);
+	// Min-heap on seconds, so that the fastest of the slowest goes first
+	vector<pair<double, string>> slowest;
+
+	void addFile(const FileResult &res) {
+		files ++;
+		if (!res.read) {
+			failed ++;
+			return;
+		}
+		scanned += res.scanned;
+		for (auto &occ : res.occurences)
+			matches += occ.second;
+		size_t bucket = 0;
+		while (bucket + 1 < BUCKETS && res.seconds * 1000 > (1 << bucket))
+			bucket ++;
+		latency[bucket] ++;
+		auto later = greater<pair<double, string>>();
+		slowest.emplace_back(res.seconds, res.fileid);
+		push_heap(slowest.begin(), slowest.end(), later);
+		if (slowest.size() > SLOWEST) {
+			pop_heap(slowest.begin(), slowest.end(), later);
+			slowest.pop_back();
+		}
+	}
+
+	json toJson(size_t charSize) const {
+		json histogram = json::array(), slow = json::array();
+		for (size_t i = 0; i < BUCKETS; i ++)
+			if (latency[i] != 0)
+				histogram.push_back({{"le_ms", i + 1 < BUCKETS ? json(1 << i) : json()},
+					{"files", latency[i]}});
+		auto sorted = slowest;
+		sort_heap(sorted.begin(), sorted.end(), greater<pair<double, string>>());
+		for (auto &file : sorted)
+			slow.push_back({{"file", file.second}, {"seconds", file.first}});
+		return {
+			{"files", files},
+			{"failed", failed},
+			{charSize == 1 ? "bytes" : "characters", scanned},
+			{"matches", matches},
+			{"seconds", seconds},
+			{"mb_per_second", seconds > 0 ? scanned * charSize / seconds / 1e6 : 0},
+			{"latency_histogram", histogram},
+			{"slowest", slow}
+		};
+	}
+};
+
+/*!
+ * \brief Scans every input file and adds the results to 'output', in the
+ * order of 'inputFiles'. With more than one thread, each worker scans with
+ * its own copy of 'matcher', which all share the same compiled automaton.
+ * With read-ahead, workers take the files in order, as they are read.
+ * Matches for the spans output are written as they are found with a single
+ * thread, and kept by SpanSpill until the file's turn otherwise.
+ */
+template<class CharType>
+void scanFiles(const vector<string> &inputFiles, const string &separator,
+		typename TermGrep<CharType>::Matcher &matcher,
+		OutputFormat<CharType> &output, const ScanOptions &opts,
+		ScanStats &stats) {
+	size_t nthreads = opts.splitSize > 0 ? 1 : min(opts.threads, inputFiles.size());
+	size_t nwidth = to_string(inputFiles.size()).length();
+	mutex logLock;
+	TermCounts counts(matcher.getTerms().size());
+	const bool spans = output.needsSpans(), direct = spans && nthreads <= 1;
+	// Buffers of the files already written, for the next ones to reuse
+	mutex spillLock;
+	vector<unique_ptr<SpanSpill>> spills;
+	ReorderBuffer<FileResult> results([&](size_t, FileResult &res) {
+		stats.addFile(res);
+		if (direct)
+			output.endFileSpans();
+		else if (spans) {
+			if (res.read) {
+				res.spans->replay(*output.startFileSpans(res.fileid, matcher.getTerms()));
+				output.endFileSpans();
+			}
+			res.spans->clear();
+			lock_guard<mutex> guard(spillLock);
+			spills.push_back(move(res.spans));
+		} else if (res.read) {
+			for (auto &occ : res.occurences)
+				counts.add(occ.first, occ.second);
+			output.addFileResult(res.fileid, matcher.getTerms(), counts);
+			counts.clear();
+		}
+	});
+	WorkStealingQueue queue(inputFiles.size(), nthreads);
+	unique_ptr<ReadAhead> readAhead;
+	if (opts.readAhead > 0) {
+		vector<string> paths;
+		for (auto &input : inputFiles)
+			paths.push_back(getFileIdentifier(input, separator).second);
+		readAhead.reset(new ReadAhead(paths, opts.readAhead, opts.ioThreads,
+			rawBlockSize(opts)));
+	}
+	auto worker = [&](size_t id) {
+		typename TermGrep<CharType>::Matcher local(matcher);
+		size_t i;
+		while (readAhead ? readAhead->next(i) : queue.next(id, i)) {
+			auto fileid = getFileIdentifier(inputFiles[i], separator);
+			{
+				lock_guard<mutex> guard(logLock);
+				cerr << "Reading ("<< setw(nwidth) << (i + 1) <<"/"<<
+					inputFiles.size() <<")"<< fileid.second << endl;
+			}
+			FileResult res;
+			res.fileid = fileid.first;
+			auto started = chrono::steady_clock::now();
+			local.reset();
+			if (direct)
+				local.setMatchSink(output.startFileSpans(res.fileid, matcher.getTerms()));
+			else if (spans) {
+				{
+					lock_guard<mutex> guard(spillLock);
+					if (!spills.empty()) {
+						res.spans = move(spills.back());
+						spills.pop_back();
+					}
+				}
+				if (!res.spans)
+					res.spans.reset(new SpanSpill());
+				local.setMatchSink(res.spans.get());
+			}
+			res.read = readAhead
+				? feedAhead<CharType>(*readAhead, i, fileid.second, local, opts, res.scanned)
+				: feedTo<CharType>(fileid.second, local, opts, res.scanned);
+			if (res.read) {
+				local.end();
+				res.seconds = secondsSince(started);
+				for (uint32_t termid : local.getCounts().touched)
+					res.occurences.emplace_back(termid,
+						local.getCounts().counts[termid]);
+			}
+			results.push(i, move(res));
+		}
+	};
+	if (nthreads <= 1)
+		worker(0);
+	else {
+		vector<thread> workers;
+		for (size_t id = 0; id < nthreads; id ++)
+			workers.emplace_back(worker, id);
+		for (auto &th : workers)
+			th.join();
+	}
+}
+
+// Documents reach the wide matcher once complete, to be decoded as UTF-8
+inline bool feedDocument(TermGrep<char>::Matcher &matcher, string &,
+		const char *data, size_t size) {
+	matcher.feed(data, size);
+	return true;
+}
+
+inline bool feedDocument(TermGrep<wchar_t>::Matcher &, string &document,
+		const char *data, size_t size) {
+	document.append(data, size);
+	return true;
+}
+
+inline bool endDocument(TermGrep<char>::Matcher &, string &) { return true; }
+
+inline bool endDocument(TermGrep<wchar_t>::Matcher &matcher, string &document) {
+	try {
+		wstring decoded = wstring_convert<codecvt_utf8<wchar_t>>().from_bytes(document);
+		matcher.feed(decoded.data(), decoded.size());
+	} catch (range_error const &) {
+		return false;
+	}
+	return true;
+}
+
+// Terms added through the server arrive as UTF-8, like its documents
+inline bool decodeTerm(const string &bytes, string &term) {
+	term = bytes;
+	return true;
+}
+
+inline bool decodeTerm(const string &bytes, wstring &term) {
+	try {
+		term = wstring_convert<codecvt_utf8<wchar_t>>().from_bytes(bytes);
+	} catch (range_error const &) {
+		return false;
+	}
 	return true;
 }
 
+/*!
+ * \brief Term list of a server, which its requests can add terms to and
+ * remove terms from. Updates are applied to 'matcher' with
+ * TermGrep::updateChecker() and bump 'generation', after which each handler
+ * copies the matcher again before its next document. 'lock' covers them,
+ * and the term list that handlers read when they respond.
+ */
+template<class CharType>
+struct ServerTerms {
+	TermGrep<CharType> &grep;
+	typename TermGrep<CharType>::Matcher &matcher;
+	mutex lock;
+	atomic<size_t> generation;
+	ServerTerms(TermGrep<CharType> &grep, typename TermGrep<CharType>::Matcher &matcher) :
+		grep(grep), matcher(matcher), generation(0) {}
+};
+
+/*!
+ * \brief Scans the documents sent to the server with its own copy of the
+ * matcher, and responds with their non-zero counts, keyed by term or, with
+ * 'termids', as [column, count] pairs (columns being termid - 1, like in
+ * the other outputs).
+ */
+template<class CharType>
+class ScanHandler : public RequestHandler {
+public:
+	typedef typename TermGrep<CharType>::Matcher Matcher;
+	ScanHandler(ServerTerms<CharType> &terms, bool termids) :
+		terms(terms), termids(termids) {}
+	void begin() override {
+		if (!matcher || generation != terms.generation) {
+			lock_guard<mutex> guard(terms.lock);
+			matcher.reset(new Matcher(terms.matcher));
+			generation = terms.generation;
+		}
+		matcher->reset();
+		document.clear();
+	}
+	void feed(const char *data, size_t size) override {
+		feedDocument(*matcher, document, data, size);
+	}
+	string end(const string &id) override {
+		if (!endDocument(*matcher, document))
+			return json({{"id", id}, {"error", "invalid UTF-8"}}).dump();
+		matcher->end();
+		auto &counts = matcher->getCounts();
+		json matches = termids ? json::array() : json::object();
+		if (termids) {
+			vector<uint32_t> touched(counts.touched);
+			sort(touched.begin(), touched.end());
+			for (uint32_t termid : touched)
+				matches.push_back({termid - 1, counts.counts[termid]});
+		} else {
+			lock_guard<mutex> guard(terms.lock);
+			for (uint32_t termid : counts.touched) {
+				auto term = toNarrowString(matcher->getTerm(termid));
+				matches[term] = matches.value(term, 0u) + counts.counts[termid];
+			}
+		}
+		return json({{"id", id}, {"matches", matches}}).dump();
+	}
+	string addTerm(const string &bytes, const string &id) override {
+		basic_string<CharType> term;
+		if (!decodeTerm(bytes, term))
+			return json({{"id", id}, {"error", "invalid UTF-8"}}).dump();
+		boost::trim(term);
+		if (term.empty())
+			return json({{"id", id}, {"error", "empty term"}}).dump();
+		lock_guard<mutex> guard(terms.lock);
+		size_t termid = terms.grep.addTerm(term);
+		terms.grep.updateChecker(terms.matcher);
+		terms.generation ++;
+		return json({{"id", id}, {"added", termid - 1}}).dump();
+	}
+	string removeTerm(unsigned long long column, const string &id) override {
+		lock_guard<mutex> guard(terms.lock);
+		if (!terms.grep.removeTerm(column + 1))
+			return json({{"id", id}, {"error", "no such term"}}).dump();
+		terms.grep.updateChecker(terms.matcher);
+		terms.generation ++;
+		return json({{"id", id}, {"removed", column}}).dump();
+	}
+private:
+	ServerTerms<CharType> &terms;
+	const bool termids;
+	unique_ptr<Matcher> matcher;
+	size_t generation = 0;
+	string document;
+};
+
 int main(int argc, char **argv) {
 	po::options_description desc("Allowed options");
 	desc.add_options()
@@ -90,13 +597,49 @@ int main(int argc, char **argv) {
 			"Separator for fileid/filepath")
 		("no-whole-words", po::bool_switch(), "Do not automatically surround "
 			"terms with \"bound-of-word\" symbols")
+		("utf8", po::bool_switch(), "Read terms and inputs as UTF-8, with "
+			"Unicode case folding and word boundaries (termgrep_main only)")
 		("output-format", po::value<string>()->default_value("json"),
-			"Output format. Supported: json (default), csv")
+			"Output format. Supported: json (default), csv, tsv, ndjson, csr, "
+			"spans (one row per match, with its position)")
+		("stream-output", po::bool_switch(), "Write each file's results as "
+			"soon as it is scanned (always done for formats other than json)")
 		("output-fsm", po::value<string>())
 		("output-matcher-fsm", po::value<string>())
+		("load-automaton", po::value<string>(),
+			"Load the matcher saved in this file instead of building it, "
+			"unless it was saved for other terms or options")
+		("save-automaton", po::value<string>(),
+			"Save the matcher to this file, for --load-automaton")
+		("engine", po::value<string>()->default_value("powerset"),
+			"How the matcher is built: powerset (fastest scan), aho-corasick "
+			"(smallest and quickest to build, slower scan) or aho-corasick-dfa "
+			"(the table of powerset, built from aho-corasick's)")
+		("lazy-dfa", po::value<size_t>(), "Build the matcher's states as "
+			"the scan visits them instead of upfront, caching at most this "
+			"many MiB of them per thread, for term lists too large to build "
+			"the whole matcher")
 		("output-file", po::value<string>())
 		("json-output-termids", po::bool_switch())
 		("csv-output-separator", po::value<string>())
+		("stats", po::value<string>()->implicit_value("-"),
+			"Write timings, automaton sizes and scan figures as JSON to this "
+			"file, or to the standard error without a value")
+		("threads", po::value<size_t>()->default_value(1),
+			"Number of files to scan in parallel (0 = one per core)")
+		("split-size", po::value<size_t>()->default_value(0),
+			"Split inputs in chunks of this many characters, scanned in "
+			"parallel by --threads threads, instead of one file per thread")
+		("read-ahead", po::value<size_t>()->default_value(0),
+			"Read input files ahead of the scan, holding at most this many "
+			"MiB (termgrep_main only)")
+		("io-threads", po::value<size_t>()->default_value(2),
+			"Number of threads reading files ahead, for --read-ahead")
+		("serve-stdin", po::bool_switch(), "Scan the documents framed on "
+			"the standard input, responding on the standard output, instead "
+			"of input files")
+		("serve-socket", po::value<string>(), "Scan the documents framed on "
+			"the connections to this Unix socket, with --threads workers")
 		("input", po::value<vector<string>>())
 		("terms-stdin", po::bool_switch())
 		("file-list-stdin", po::bool_switch());
@@ -116,37 +659,152 @@ int main(int argc, char **argv) {
 	const bool
 		wholeWords = !vm["no-whole-words"].as<bool>(),
 		termsStdin = vm["terms-stdin"].as<bool>(),
-		fileListStdin = vm["file-list-stdin"].as<bool>();
+		fileListStdin = vm["file-list-stdin"].as<bool>(),
+		utf8 = vm["utf8"].as<bool>();
 
-	TermGrep<> grep(wholeWords);
+	TermGrep<> grep(wholeWords, utf8);
 
 	if (vm.count("help")) {
 		cout << desc << endl;
 		return 0;
 	}
+	if (utf8 && sizeof(DefaultCharType) != 1) {
+		cerr << "--utf8 is only supported by termgrep_main" << endl;
+		return 1;
+	}
+	if (vm["read-ahead"].as<size_t>() > 0 && sizeof(DefaultCharType) != 1) {
+		cerr << "--read-ahead is only supported by termgrep_main" << endl;
+		return 1;
+	}
 	if (termsStdin && fileListStdin) {
 		cerr << "Can't use both --terms-stdin and --file-list-stdin" << endl;
 		return 1;
 	}
+	const bool lazy = vm.count("lazy-dfa") != 0;
+	if (lazy && (vm.count("load-automaton") || vm.count("save-automaton"))) {
+		cerr << "A --lazy-dfa matcher can't be saved or loaded" << endl;
+		return 1;
+	}
+	MatcherEngine engine;
+	try {
+		engine = getEngineByName(vm["engine"].as<string>());
+	} catch (runtime_error &er) {
+		cerr << er.what() << endl
+			<< "Supported engines: powerset, aho-corasick, aho-corasick-dfa" << endl;
+		return 1;
+	}
+	if (lazy && engine != MatcherEngine::POWERSET) {
+		cerr << "--lazy-dfa only works with --engine powerset" << endl;
+		return 1;
+	}
+	const bool serveStdin = vm["serve-stdin"].as<bool>();
+	if (termsStdin && serveStdin) {
+		cerr << "Can't use both --terms-stdin and --serve-stdin" << endl;
+		return 1;
+	}
 	if (!vm.count("input") && termsStdin) {
 		cerr << "Error : no input file(s) specified and stdin reserved for terms" << endl;
 		return 1;
 	}
 
+	json stats;
+	auto started = chrono::steady_clock::now();
+	vector<basic_string<DefaultCharType>> terms;
 	if (!vm.count("terms") && !termsStdin) {
 		cerr << "Must specify terms file or use --terms-stdin" << endl;
 		return 1;
 	} else if (!termsStdin)
-		readTermsFrom(grep, vm["terms"].as<string>());
+		readTermsFrom(terms, vm["terms"].as<string>());
 	else
-		readTermsFrom(grep, in());
-	auto matcher = grep.makeChecker();
+		readTermsFrom(terms, in());
+	stats["terms"] = {{"count", terms.size()}, {"read_seconds", secondsSince(started)}};
+	const uint64_t key = automatonKey(terms, wholeWords, utf8, engine);
+
+	unique_ptr<TermGrep<>::Matcher> matcher;
+	// A loaded matcher only has its table, there are no states to draw
+	if (vm.count("load-automaton") &&
+			!vm.count("output-fsm") && !vm.count("output-matcher-fsm")) {
+		auto path = vm["load-automaton"].as<string>();
+		started = chrono::steady_clock::now();
+		matcher = grep.loadChecker(path, key);
+		stats["automaton"]["load_seconds"] = secondsSince(started);
+		if (matcher)
+			cerr << "Successfully read "<< grep.getTerms().size() << " terms" << endl
+				<< "Loaded matcher from "<< path << endl;
+		else
+			cerr << "No matcher for these terms in "<< path << ", rebuilding it" << endl;
+	}
+	if (!matcher) {
+		for (auto &term : terms)
+			grep.addTerm(term);
+		cerr << "Successfully read "<< grep.getTerms().size() << " terms" << endl;
+		matcher = lazy ? grep.makeLazyChecker(vm["lazy-dfa"].as<size_t>() << 20) :
+			grep.makeChecker(engine);
+		auto &build = matcher->getBuildStats();
+		cerr << "Built matcher: "<< build.states << " states, "<< build.edges
+			<< " edges, minimized to "<< build.minimizedStates << " states, "
+			<< build.minimizedEdges << " edges in "<< build.seconds << "s (peak ~"
+			<< (build.peakBytes >> 20) << " MiB)" << endl;
+		auto trie = grep.getTrieStats();
+		stats["trie"] = {{"seconds", trie.seconds}, {"states", trie.states},
+			{"bytes", trie.bytes}};
+		stats["automaton"]["subset_seconds"] = build.subsetSeconds;
+		stats["automaton"]["compile_seconds"] = build.compileSeconds;
+		stats["automaton"]["build_seconds"] = build.seconds;
+		stats["automaton"]["states"] = build.states;
+		stats["automaton"]["edges"] = build.edges;
+		stats["automaton"]["minimized_states"] = build.minimizedStates;
+		stats["automaton"]["minimized_edges"] = build.minimizedEdges;
+		stats["automaton"]["peak_bytes"] = build.peakBytes;
+	}
+	stats["automaton"]["loaded"] = !stats.count("trie");
+	stats["automaton"]["lazy"] = lazy;
+	stats["automaton"]["engine"] = vm["engine"].as<string>();
+	stats["automaton"]["table_bytes"] = matcher->getTableBytes();
+	matcher->setKeepMatches(false);
+	if (vm.count("save-automaton")) {
+		try {
+			matcher->save(vm["save-automaton"].as<string>(), key);
+		} catch (runtime_error const &ex) {
+			cerr << "Error : "<< ex.what() << endl;
+			return 1;
+		}
+	}
 	if (vm.count("output-fsm"))
 		basic_ofstream<DefaultCharType>(vm["output-fsm"].as<string>())
 			<< *grep.getGraph();
 	if (vm.count("output-matcher-fsm"))
 		basic_ofstream<DefaultCharType>(vm["output-matcher-fsm"].as<string>())
 			<< *matcher->getGraph();
+	// The scan only needs the compiled table, and the trie is only kept for
+	// the terms a server can add or remove
+	const bool serving = serveStdin || vm.count("serve-socket");
+	matcher->releaseStates();
+	if (!serving)
+		grep.releaseStates();
+
+	if (serving) {
+		const bool termids = vm["json-output-termids"].as<bool>();
+		ServerTerms<DefaultCharType> serverTerms(grep, *matcher);
+		auto makeHandler = [&]() {
+			return unique_ptr<RequestHandler>(
+				new ScanHandler<DefaultCharType>(serverTerms, termids));
+		};
+		if (serveStdin) {
+			auto handler = makeHandler();
+			return serveStream(STDIN_FILENO, STDOUT_FILENO, *handler) ? 0 : 1;
+		}
+		size_t workers = vm["threads"].as<size_t>();
+		if (workers == 0)
+			workers = max(1u, thread::hardware_concurrency());
+		try {
+			cerr << "Serving on "<< vm["serve-socket"].as<string>() << endl;
+			serveSocket(vm["serve-socket"].as<string>(), workers, makeHandler);
+		} catch (runtime_error const &ex) {
+			cerr << "Error : "<< ex.what() << endl;
+			return 1;
+		}
+	}
 
 	vector<string> inputFiles;
 	if (vm.count("input"))
@@ -172,37 +830,72 @@ int main(int argc, char **argv) {
 		format = getFormatByName(vm["output-format"].as<string>());
 	} catch (runtime_error &er) {
 		cerr << er.what() << endl
-			<< "Supported output formats: JSON, CSV, TSV" << endl;
+			<< "Supported output formats: JSON, CSV, TSV, NDJSON, CSR, SPANS" << endl;
 		return 1;
 	}
-	auto result =
-		OutputFormat<DefaultCharType>::makeOutput(format, opts);
+	// Streamed rows are the same as buffered ones, except for the JSON array
+	// which is then written compactly instead of indented
+	const bool stream = vm["stream-output"].as<bool>() || format != Formats::JSON;
+	unique_ptr<ofstream> outFile;
+	if (vm.count("output-file")) {
+		cout << "Writing results to "<< vm["output-file"].as<string>() << endl;
+		outFile.reset(new ofstream(vm["output-file"].as<string>()));
+	}
+	ostream &out = outFile ? *outFile : cout;
+	auto result = stream
+		? OutputFormat<DefaultCharType>::makeOutput(format, opts, out)
+		: OutputFormat<DefaultCharType>::makeOutput(format, opts);
 
+	ScanOptions scanOpts;
+	scanOpts.threads = vm["threads"].as<size_t>();
+	if (scanOpts.threads == 0)
+		scanOpts.threads = max(1u, thread::hardware_concurrency());
+	scanOpts.splitSize = vm["split-size"].as<size_t>();
+	scanOpts.readAhead = vm["read-ahead"].as<size_t>() << 20;
+	scanOpts.ioThreads = vm["io-threads"].as<size_t>();
+
+	ScanStats scanStats;
+	started = chrono::steady_clock::now();
 	if (!inputFiles.empty()) {
-		size_t nwidth = to_string(inputFiles.size()).length(),
-			fcount = 0;
-		for (auto fname : inputFiles) {
-			auto fileid = getFileIdentifier(fname,
-				vm["fileid-separator"].as<string>());
-			cerr << "Reading ("<< setw(nwidth) << (++fcount) <<"/"<<
-				inputFiles.size() <<")"<< fileid.second << endl;
-			if (feedTo<DefaultCharType>(fileid.second, *matcher)) {
-				matcher->end();
-				result->addFileResult(fileid.first, *matcher);
-				matcher->reset();
-			}
-		}
+		scanFiles(inputFiles, vm["fileid-separator"].as<string>(),
+			*matcher, *result, scanOpts, scanStats);
 	} else {
 		cerr << "Reading from standard input" << endl;
-		in() >> *matcher;
+		FileResult res;
+		res.fileid = "stdin";
+		res.read = true;
+		if (result->needsSpans())
+			matcher->setMatchSink(result->startFileSpans("stdin", matcher->getTerms()));
+		feedStdin<DefaultCharType>(*matcher, scanOpts, res.scanned);
 		matcher->end();
-		result->addFileResult("stdin", *matcher);
+		res.seconds = secondsSince(started);
+		for (uint32_t termid : matcher->getCounts().touched)
+			res.occurences.emplace_back(termid, matcher->getCounts().counts[termid]);
+		scanStats.addFile(res);
+		if (result->needsSpans())
+			result->endFileSpans();
+		else
+			result->addFileResult("stdin", *matcher);
 	}
-	if (vm.count("output-file")) {
-		cout << "Writing results to "<< vm["output-file"].as<string>() << endl;
-		ofstream(vm["output-file"].as<string>()) << *result << flush;
-	} else {
+	scanStats.seconds = secondsSince(started);
+	if (outFile || format == Formats::NDJSON || format == Formats::CSR ||
+			format == Formats::SPANS)
+		out << *result << flush;
+	else if (stream)
+		out << *result << endl;
+	else
 		cout << setw(2) << *result << endl;
+
+	if (vm.count("stats")) {
+		stats["scan"] = scanStats.toJson(sizeof(DefaultCharType));
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) == 0)
+			stats["max_rss_bytes"] = (size_t) usage.ru_maxrss << 10;
+		const string path = vm["stats"].as<string>();
+		if (path == "-")
+			cerr << stats.dump() << endl;
+		else
+			ofstream(path) << stats.dump() << endl;
 	}
 	return 0;
 }
@@ -1,6 +1,9 @@
 #include "termgrep.hpp"
 #include <json.hpp>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <codecvt>
 #include <boost/algorithm/string/predicate.hpp>
@@ -31,7 +34,10 @@ namespace termgrep {
     enum Formats {
         JSON,
         CSV,
-        TSV
+        TSV,
+        NDJSON,
+        CSR,
+        SPANS
     };
 
     template <class CharType>
@@ -41,8 +47,37 @@ namespace termgrep {
     public:
         static std::unique_ptr<OutputFormat<CharType>>
             makeOutput(Formats format, OutputOptions options);
+        /*!
+         * \brief Makes an output that writes each file's results to 'os'
+         * as soon as they are added, so that memory use doesn't grow with
+         * the number of files. Writing the output to 'os' afterwards
+         * completes it. JSON is written as a compact array.
+         */
+        static std::unique_ptr<OutputFormat<CharType>>
+            makeOutput(Formats format, OutputOptions options, std::ostream &os);
+        void addFileResult(std::string fname,
+            typename TermGrep<CharType>::Matcher &matcher) {
+            addFileResult(fname, matcher.getTerms(), matcher.getCounts());
+        }
+        /*!
+         * \brief Adds the result of one file, given as the number of
+         * occurences of each termid.
+         */
         virtual void addFileResult(std::string fname,
-            typename TermGrep<CharType>::Matcher &matcher) = 0;
+            const vector<strtype> &terms, const TermCounts &counts) = 0;
+        /*!
+         * \brief Whether the output is made of the matches themselves, in
+         * which case files are added with startFileSpans() instead.
+         */
+        virtual bool needsSpans() const { return false; }
+        /*!
+         * \brief Starts the rows of file 'fname': its matches are then
+         * passed to the sink returned, in input order, until
+         * endFileSpans(). The rows may be written as they come.
+         */
+        virtual MatchSink *startFileSpans(std::string fname,
+            const vector<strtype> &terms) { return nullptr; }
+        virtual void endFileSpans() {}
     protected:
         virtual void write(std::ostream &os) const = 0;
         OutputFormat(OutputOptions options) : options(options) {}
@@ -51,26 +86,67 @@ namespace termgrep {
     };
 
 
+    /*!
+     * \brief Keys of the {term: count} objects of the JSON outputs, made once
+     * per term list instead of once per file: the distinct terms in
+     * ascending order, with the termids they have. They are those of a map
+     * of every term but the last one, plus the terms that occur.
+     */
+    template <class CharType = DefaultCharType>
+    class TermKeys {
+    public:
+        struct Key {
+            //! The term in UTF-8, quoted as a JSON string if asked to
+            std::string name;
+            //! Its termids are termids[firstId] to termids[lastId - 1]
+            uint32_t firstId, lastId;
+            //! Only the last term has it, which is left out if it doesn't occur
+            bool optional;
+        };
+        TermKeys(bool quoted) : quoted(quoted) {}
+        //! The keys of 'terms', only sorted again when terms were added
+        const vector<Key> &get(const vector<strtype> &terms);
+        //! Occurences of the term of 'key' in a file
+        size_t count(const Key &key, const TermCounts &counts) const {
+            size_t n = 0;
+            for (uint32_t i = key.firstId; i < key.lastId; i ++)
+                n += counts.counts[termids[i]];
+            return n;
+        }
+    private:
+        const bool quoted;
+        const vector<strtype> *terms = nullptr;
+        size_t nterms = 0;
+        vector<Key> keys;
+        vector<uint32_t> termids;
+    };
+
     template <class CharType = DefaultCharType>
     class JSONOutputFormat : public OutputFormat<CharType> {
         friend std::unique_ptr<OutputFormat<CharType>>
             OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options);
     public:
         virtual void addFileResult(std::string fname,
-            typename TermGrep<CharType>::Matcher &matcher) override {
+            const vector<strtype> &terms, const TermCounts &counts) override {
             json fileData;
             if (this->options.outputTermids) {
-    			auto occmap = matcher.getTermidOccurences();
-    			for (size_t i = 1; i < matcher.getTerms().size(); i ++)
-    				fileData.push_back(occmap[i]);
+    			for (size_t i = 1; i < terms.size(); i ++)
+    				fileData.push_back(counts.counts[i]);
             } else {
-                auto occMap = matcher.getTermOccurences();
-                for (auto &match : occMap)
-                    fileData[toNarrowString(match.first)] = match.second;
+                for (auto &key : keys.get(terms)) {
+                    const size_t n = keys.count(key, counts);
+                    if (n == 0 && key.optional)
+                        continue;
+                    if (fileData.is_null())
+                        fileData = json::object();
+                    // Keys come in order, so each one goes at the end
+                    auto &object = fileData.template get_ref<json::object_t &>();
+                    object.emplace_hint(object.end(), key.name, n);
+                }
             }
             data.push_back(json::object({
                 {"file", fname},
-                {"matches", fileData}
+                {"matches", move(fileData)}
             }));
         }
     private:
@@ -78,6 +154,7 @@ namespace termgrep {
             os << data;
         }
         json data;
+        TermKeys<CharType> keys{false};
         JSONOutputFormat(OutputOptions options) : OutputFormat<CharType>(options) {}
     };
 
@@ -87,12 +164,11 @@ namespace termgrep {
             OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options);
     public:
         virtual void addFileResult(std::string fname,
-            typename TermGrep<CharType>::Matcher &matcher) override {
+            const vector<strtype> &terms, const TermCounts &counts) override {
             json fileData;
-            terms = &matcher.getTerms();
-			auto occmap = matcher.getTermidOccurences();
-			for (size_t i = 1; i < terms->size(); i ++)
-				fileData.push_back(occmap[i]);
+            this->terms = &terms;
+			for (size_t i = 1; i < terms.size(); i ++)
+				fileData.push_back(counts.counts[i]);
             data.push_back(json::object({
                 {"file", fname},
                 {"matches", fileData}
@@ -122,6 +198,333 @@ namespace termgrep {
         CSVOutputFormat(OutputOptions options) : OutputFormat<CharType>(options) {}
     };
 
+    /*!
+     * \brief Base of the outputs made by the streaming makeOutput(): rows
+     * are formatted into a buffer and written to the stream in one go.
+     */
+    template <class CharType = DefaultCharType>
+    class StreamingOutputFormat : public OutputFormat<CharType> {
+        friend class TermKeys<CharType>;
+    protected:
+        StreamingOutputFormat(OutputOptions options, std::ostream &os) :
+            OutputFormat<CharType>(options), os(os) {}
+        std::ostream &os;
+        std::string row;
+        void writeRow() {
+            os.write(row.data(), row.size());
+            row.clear();
+        }
+        //! Appends 'str' as a JSON string, escaped like nlohmann::json does
+        void appendString(const std::string &str) { appendString(row, str); }
+        static void appendString(std::string &row, const std::string &str) {
+            static const char *HEX = "0123456789abcdef";
+            row += '"';
+            for (char chr : str) {
+                switch (chr) {
+                case '"': row += "\\\""; break;
+                case '\\': row += "\\\\"; break;
+                case '\b': row += "\\b"; break;
+                case '\f': row += "\\f"; break;
+                case '\n': row += "\\n"; break;
+                case '\r': row += "\\r"; break;
+                case '\t': row += "\\t"; break;
+                default:
+                    if ((unsigned char) chr < 0x20) {
+                        row += "\\u00";
+                        row += HEX[chr >> 4];
+                        row += HEX[chr & 0xF];
+                    } else
+                        row += chr;
+                }
+            }
+            row += '"';
+        }
+        void appendCount(size_t count) {
+            char buf[24];
+            row.append(buf, snprintf(buf, sizeof(buf), "%zu", count));
+        }
+        //! Appends the same object as a JSONOutputFormat array element
+        void appendObject(const std::string &fname,
+            const vector<strtype> &terms, const TermCounts &counts) {
+            row += "{\"file\":";
+            appendString(fname);
+            row += ",\"matches\":";
+            if (this->options.outputTermids && terms.size() <= 1) {
+                row += "null";
+            } else if (this->options.outputTermids) {
+                row += '[';
+                for (size_t i = 1; i < terms.size(); i ++) {
+                    if (i > 1)
+                        row += ',';
+                    appendCount(counts.counts[i]);
+                }
+                row += ']';
+            } else {
+                row += '{';
+                for (auto &key : keys.get(terms)) {
+                    const size_t n = keys.count(key, counts);
+                    if (n == 0 && key.optional)
+                        continue;
+                    if (row.back() != '{')
+                        row += ',';
+                    row += key.name;
+                    row += ':';
+                    appendCount(n);
+                }
+                row += '}';
+            }
+            row += '}';
+        }
+    private:
+        TermKeys<CharType> keys{true};
+    };
+
+    //! One JSON object per line and per file
+    template <class CharType = DefaultCharType>
+    class NDJSONOutputFormat : public StreamingOutputFormat<CharType> {
+        friend std::unique_ptr<OutputFormat<CharType>>
+            OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options,
+                std::ostream &os);
+    public:
+        virtual void addFileResult(std::string fname,
+            const vector<strtype> &terms, const TermCounts &counts) override {
+            this->appendObject(fname, terms, counts);
+            this->row += '\n';
+            this->writeRow();
+        }
+    private:
+        void write(std::ostream &os) const override {}
+        NDJSONOutputFormat(OutputOptions options, std::ostream &os) :
+            StreamingOutputFormat<CharType>(options, os) {}
+    };
+
+    //! The JSONOutputFormat array, closed when the output is written
+    template <class CharType = DefaultCharType>
+    class JSONStreamOutputFormat : public StreamingOutputFormat<CharType> {
+        friend std::unique_ptr<OutputFormat<CharType>>
+            OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options,
+                std::ostream &os);
+    public:
+        virtual void addFileResult(std::string fname,
+            const vector<strtype> &terms, const TermCounts &counts) override {
+            this->row += rows ++ == 0 ? '[' : ',';
+            this->appendObject(fname, terms, counts);
+            this->writeRow();
+        }
+    private:
+        size_t rows = 0;
+        void write(std::ostream &os) const override {
+            os << (rows == 0 ? "[]" : "]");
+        }
+        JSONStreamOutputFormat(OutputOptions options, std::ostream &os) :
+            StreamingOutputFormat<CharType>(options, os) {}
+    };
+
+    //! The same rows as CSVOutputFormat, the header coming with the first one
+    template <class CharType = DefaultCharType>
+    class CSVStreamOutputFormat : public StreamingOutputFormat<CharType> {
+        friend std::unique_ptr<OutputFormat<CharType>>
+            OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options,
+                std::ostream &os);
+    public:
+        virtual void addFileResult(std::string fname,
+            const vector<strtype> &terms, const TermCounts &counts) override {
+            const std::string &sep = this->options.separator;
+            if (!headerWritten) {
+                this->row += "filename";
+                for (size_t i = 1; i < terms.size(); i ++) {
+                    this->row += sep;
+                    this->row += toNarrowString(terms[i]);
+                }
+                this->row += '\n';
+                headerWritten = true;
+            }
+            this->appendString(fname);
+            for (size_t i = 1; i < terms.size(); i ++) {
+                this->row += sep;
+                this->appendCount(counts.counts[i]);
+            }
+            this->row += '\n';
+            this->writeRow();
+        }
+    private:
+        bool headerWritten = false;
+        void write(std::ostream &os) const override {}
+        CSVStreamOutputFormat(OutputOptions options, std::ostream &os) :
+            StreamingOutputFormat<CharType>(options, os) {}
+    };
+
+    /*!
+     * \brief One CSV row per match: the file, the start and end positions of
+     * the match in the file (in characters, or in bytes for a UTF-8 matcher,
+     * the end being excluded) and its term, or its column with
+     * outputTermids. The output is itself the sink of the matches, which it
+     * formats into the rows it writes every 64 KiB.
+     */
+    template <class CharType = DefaultCharType>
+    class SpansOutputFormat : public StreamingOutputFormat<CharType>, public MatchSink {
+        friend std::unique_ptr<OutputFormat<CharType>>
+            OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options,
+                std::ostream &os);
+    public:
+        virtual void addFileResult(std::string fname,
+            const vector<strtype> &terms, const TermCounts &counts) override {
+            throw std::runtime_error("The spans output needs the matches");
+        }
+        bool needsSpans() const override { return true; }
+        virtual MatchSink *startFileSpans(std::string fname,
+            const vector<strtype> &terms) override {
+            const std::string &sep = this->options.separator;
+            if (!headerWritten) {
+                this->row += "filename" + sep + "start" + sep + "end" + sep;
+                this->row += this->options.outputTermids ? "column\n" : "term\n";
+                headerWritten = true;
+            }
+            while (!this->options.outputTermids && names.size() < terms.size()) {
+                names.emplace_back();
+                this->appendString(names.back(), toNarrowString(terms[names.size() - 1]));
+            }
+            file.clear();
+            this->appendString(file, fname);
+            file += sep;
+            return this;
+        }
+        void match(size_t termid, size_t startPos, size_t endPos) override {
+            const std::string &sep = this->options.separator;
+            this->row += file;
+            this->appendCount(startPos);
+            this->row += sep;
+            this->appendCount(endPos);
+            this->row += sep;
+            if (this->options.outputTermids)
+                this->appendCount(termid - 1);
+            else
+                this->row += names[termid];
+            this->row += '\n';
+            if (this->row.size() >= 1 << 16)
+                this->writeRow();
+        }
+        void endFileSpans() override { this->writeRow(); }
+    private:
+        bool headerWritten = false;
+        // Quoted terms, by termid
+        vector<std::string> names;
+        // Quoted name of the current file, and the separator after it
+        std::string file;
+        void write(std::ostream &os) const override {}
+        SpansOutputFormat(OutputOptions options, std::ostream &os) :
+            StreamingOutputFormat<CharType>(options, os) {}
+    };
+
+    /*!
+     * \brief Binary sparse term-by-document matrix, in compressed sparse row
+     * form. All integers are little-endian:
+     *
+     *     char[8]  "TGREPCSR"
+     *     uint32   version, uint32 reserved (0)
+     *     for each document, as it is added:
+     *         uint32 columns[nnz], uint32 counts[nnz]
+     *     uint64   ndocs, nterms
+     *     uint64   offsets[ndocs + 1], of each document's first entry
+     *     ndocs  x (uint32 length, bytes) document names
+     *     nterms x (uint32 length, bytes) terms, in UTF-8
+     *     uint64   position of ndocs
+     *
+     * Columns are termid - 1, like the columns of CSV, and are sorted within
+     * a document. A document's entries start at byte 16 + 8 * offsets[doc].
+     */
+    template <class CharType = DefaultCharType>
+    class CSROutputFormat : public StreamingOutputFormat<CharType> {
+        friend std::unique_ptr<OutputFormat<CharType>>
+            OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options,
+                std::ostream &os);
+    public:
+        static const uint32_t VERSION = 1;
+
+        virtual void addFileResult(std::string fname,
+            const vector<strtype> &terms, const TermCounts &counts) override {
+            this->terms = &terms;
+            columns.clear();
+            for (uint32_t termid : counts.touched)
+                if (termid != 0)
+                    columns.push_back(termid);
+            sort(columns.begin(), columns.end());
+            for (uint32_t termid : columns)
+                appendLE(this->row, termid - 1);
+            for (uint32_t termid : columns)
+                appendLE(this->row, counts.counts[termid]);
+            this->writeRow();
+            names.push_back(move(fname));
+            offsets.push_back(offsets.back() + columns.size());
+        }
+    private:
+        const vector<strtype> *terms = nullptr;
+        vector<std::string> names;
+        vector<uint64_t> offsets = {0};
+        vector<uint32_t> columns;
+
+        template<class T>
+        static void appendLE(std::string &out, T value) {
+            for (size_t i = 0; i < sizeof(T); i ++)
+                out += (char) (value >> (8 * i) & 0xFF);
+        }
+        static void appendName(std::string &out, const std::string &name) {
+            appendLE(out, (uint32_t) name.size());
+            out += name;
+        }
+        void write(std::ostream &os) const override {
+            const uint64_t nterms = terms != nullptr ? terms->size() - 1 : 0;
+            std::string trailer;
+            appendLE(trailer, (uint64_t) names.size());
+            appendLE(trailer, nterms);
+            for (uint64_t offset : offsets)
+                appendLE(trailer, offset);
+            for (auto &name : names)
+                appendName(trailer, name);
+            for (size_t i = 1; i <= nterms; i ++)
+                appendName(trailer, toNarrowString((*terms)[i]));
+            appendLE(trailer, (uint64_t) 16 + 8 * offsets.back());
+            os.write(trailer.data(), trailer.size());
+        }
+        CSROutputFormat(OutputOptions options, std::ostream &os) :
+            StreamingOutputFormat<CharType>(options, os) {
+            this->row.append("TGREPCSR", 8);
+            appendLE(this->row, VERSION);
+            appendLE(this->row, (uint32_t) 0);
+            this->writeRow();
+        }
+    };
+
+    template <class CharType>
+    const vector<typename TermKeys<CharType>::Key> &
+        TermKeys<CharType>::get(const vector<strtype> &terms) {
+        if (&terms == this->terms && terms.size() == nterms)
+            return keys;
+        this->terms = &terms;
+        nterms = terms.size();
+        termids.resize(nterms);
+        for (size_t i = 0; i < nterms; i ++)
+            termids[i] = i;
+        std::stable_sort(termids.begin(), termids.end(),
+            [&terms](uint32_t a, uint32_t b) { return terms[a] < terms[b]; });
+        keys.clear();
+        for (uint32_t i = 0; i < nterms; i ++) {
+            if (i == 0 || terms[termids[i]] != terms[termids[i - 1]]) {
+                std::string name = toNarrowString(terms[termids[i]]);
+                if (quoted) {
+                    std::string quoted;
+                    StreamingOutputFormat<CharType>::appendString(quoted, name);
+                    name.swap(quoted);
+                }
+                keys.push_back(Key{move(name), i, i, true});
+            }
+            keys.back().lastId = i + 1;
+            if (termids[i] + 1 < nterms)
+                keys.back().optional = false;
+        }
+        return keys;
+    }
+
     template <class CharType>
     std::unique_ptr<OutputFormat<CharType>>
         OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options) {
@@ -136,6 +539,39 @@ namespace termgrep {
             options.separator = "\t";
             return std::unique_ptr<OutputFormat<CharType>>
                 (new CSVOutputFormat<CharType>(options));
+        case NDJSON:
+        case CSR:
+        case SPANS:
+            throw std::runtime_error("This output format can only be streamed");
+        default:
+            throw std::runtime_error("Unknown format");
+        }
+    }
+
+    template <class CharType>
+    std::unique_ptr<OutputFormat<CharType>>
+        OutputFormat<CharType>::makeOutput(Formats format, OutputOptions options,
+            std::ostream &os) {
+        switch (format) {
+        case JSON:
+            return std::unique_ptr<OutputFormat<CharType>>
+                (new JSONStreamOutputFormat<CharType>(options, os));
+        case NDJSON:
+            return std::unique_ptr<OutputFormat<CharType>>
+                (new NDJSONOutputFormat<CharType>(options, os));
+        case CSR:
+            return std::unique_ptr<OutputFormat<CharType>>
+                (new CSROutputFormat<CharType>(options, os));
+        case SPANS:
+            return std::unique_ptr<OutputFormat<CharType>>
+                (new SpansOutputFormat<CharType>(options, os));
+        case CSV:
+            return std::unique_ptr<OutputFormat<CharType>>
+                (new CSVStreamOutputFormat<CharType>(options, os));
+        case TSV:
+            options.separator = "\t";
+            return std::unique_ptr<OutputFormat<CharType>>
+                (new CSVStreamOutputFormat<CharType>(options, os));
         default:
             throw std::runtime_error("Unknown format");
         }
@@ -148,6 +584,12 @@ namespace termgrep {
             return Formats::CSV;
         if (boost::iequals(format, "tsv"))
             return Formats::TSV;
+        if (boost::iequals(format, "ndjson"))
+            return Formats::NDJSON;
+        if (boost::iequals(format, "csr"))
+            return Formats::CSR;
+        if (boost::iequals(format, "spans"))
+            return Formats::SPANS;
         throw std::runtime_error("Unknown format");
     }
 
@@ -0,0 +1,271 @@
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+#include <initializer_list>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    !defined(TERMGREP_NO_SIMD)
+#define TERMGREP_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace termgrep {
+
+    /*!
+     * \brief Finds where a matcher sitting on its root state can leave it,
+     * so that the characters before can be skipped without stepping them.
+     *
+     * It is built from the pairs of characters below 256 that can lead out
+     * of the root: 'pairs' has the bit (first << 8 | second) set when the
+     * first character, followed by the second one, either ends a term or
+     * doesn't bring the matcher back to the root. 'starts' has the bit of
+     * the characters that lead out of the root on their own, for the last
+     * character of the input. Anything at or above 256 is a candidate.
+     * Some alive pairs can then be narrowed down to the third characters
+     * that keep them alive with refine().
+     *
+     * Bytes are scanned a vector at a time when the CPU has AVX2 or SSSE3,
+     * chosen at runtime, Teddy-style: the pairs are put into 8 buckets of
+     * first and second characters, whose low and high nibbles are looked
+     * up with a byte shuffle. That gives a superset of the candidates, which
+     * are then checked against 'pairs'. Wider characters are scanned one by
+     * one.
+     */
+    class Prefilter {
+    public:
+        Prefilter(const std::vector<uint64_t> &pairs, const std::vector<uint64_t> &starts) :
+                pairs(pairs), starts(starts) {
+            makeBuckets();
+            kernel = scalarKernel;
+            kernelName = "scalar";
+#ifdef TERMGREP_X86_SIMD
+            if (__builtin_cpu_supports("avx2")) {
+                kernel = avx2Kernel;
+                kernelName = "avx2";
+            } else if (__builtin_cpu_supports("ssse3")) {
+                kernel = ssse3Kernel;
+                kernelName = "ssse3";
+            }
+#endif
+        }
+
+        /*!
+         * \brief Only lets the pair (c0, c1) through when followed by one
+         * of the characters set in the 256 bits of 'thirds'. Returns false
+         * once there is no more room for such pairs.
+         */
+        bool refine(unsigned c0, unsigned c1, const uint64_t *thirds) {
+            if (thirdRow.empty()) {
+                thirdRow.assign(1 << 16, 0);
+                this->thirds.assign(4, 0); // Row 0 stands for no refinement
+            }
+            const size_t row = this->thirds.size() / 4;
+            if (row > MAX_REFINED)
+                return false;
+            thirdRow[c0 << 8 | c1] = row;
+            this->thirds.insert(this->thirds.end(), thirds, thirds + 4);
+            return true;
+        }
+
+        //! Number of leading characters of 'data' that can be skipped
+        size_t skip(const char *data, size_t n) const {
+            return kernel(*this, (const unsigned char *) data, n);
+        }
+        size_t skip(const wchar_t *data, size_t n) const {
+            typedef std::make_unsigned<wchar_t>::type UChar;
+            const UChar *chars = (const UChar *) data;
+            for (size_t i = 0; i < n; i ++)
+                if (candidate(chars, i, n))
+                    return i;
+            return n;
+        }
+
+        //! The implementation chosen for bytes: "avx2", "ssse3" or "scalar"
+        const char *name() const { return kernelName; }
+    private:
+        typedef size_t (*Kernel)(const Prefilter &, const unsigned char *, size_t);
+        static const size_t NBUCKETS = 8;
+        static const size_t MAX_REFINED = 4095;
+
+        std::vector<uint64_t> pairs, starts;
+        // Refined pairs -> their row of 256 bits in 'thirds', 0 if none
+        std::vector<uint16_t> thirdRow;
+        std::vector<uint64_t> thirds;
+        // Bucket masks of the low and high nibbles of the first and second
+        // characters, repeated for both lanes of an AVX2 shuffle
+        uint8_t lo0[32] = {0}, hi0[32] = {0}, lo1[32] = {0}, hi1[32] = {0};
+        Kernel kernel;
+        const char *kernelName;
+
+        inline bool alive(unsigned c0, unsigned c1) const {
+            const unsigned bit = (c0 & 0xFF) << 8 | (c1 & 0xFF);
+            return (pairs[bit >> 6] >> (bit & 63)) & 1;
+        }
+        inline bool start(unsigned c) const {
+            return (starts[(c & 0xFF) >> 6] >> (c & 63)) & 1;
+        }
+        //! Whether the character at 'pos' may lead out of the root
+        template<class UChar>
+        inline bool candidate(const UChar *data, size_t pos, size_t n) const {
+            if (data[pos] >= 256 || (pos + 1 < n && data[pos + 1] >= 256))
+                return true;
+            if (pos + 1 == n)
+                return start(data[pos]);
+            if (!alive(data[pos], data[pos + 1]))
+                return false;
+            if (pos + 2 == n || thirdRow.empty() || data[pos + 2] >= 256)
+                return true;
+            const size_t row = thirdRow[data[pos] << 8 | data[pos + 1]];
+            const unsigned c2 = data[pos + 2];
+            return row == 0 || ((thirds[row * 4 + (c2 >> 6)] >> (c2 & 63)) & 1);
+        }
+
+        /*!
+         * First characters with the same set of second characters share a
+         * bucket. While there are more than NBUCKETS of them, the two
+         * buckets whose merge adds the fewest pairs are merged.
+         */
+        void makeBuckets() {
+            typedef std::vector<uint64_t> Bits;
+            std::vector<Bits> firsts, seconds;
+            for (unsigned c0 = 0; c0 < 256; c0 ++) {
+                Bits second(pairs.begin() + c0 * 4, pairs.begin() + c0 * 4 + 4);
+                if (second == Bits(4, 0))
+                    continue;
+                auto same = std::find(seconds.begin(), seconds.end(), second);
+                if (same == seconds.end()) {
+                    seconds.push_back(second);
+                    firsts.push_back(Bits(4, 0));
+                    same = seconds.end() - 1;
+                }
+                firsts[same - seconds.begin()][c0 >> 6] |= (uint64_t) 1 << (c0 & 63);
+            }
+            auto count = [](const Bits &bits) {
+                size_t n = 0;
+                for (uint64_t word : bits)
+                    n += __builtin_popcountll(word);
+                return n;
+            };
+            std::vector<size_t> nfirsts, nseconds;
+            for (size_t i = 0; i < firsts.size(); i ++) {
+                nfirsts.push_back(count(firsts[i]));
+                nseconds.push_back(count(seconds[i]));
+            }
+            while (firsts.size() > NBUCKETS) {
+                size_t best = SIZE_MAX, a = 0, b = 0;
+                for (size_t i = 0; i < firsts.size(); i ++)
+                    for (size_t j = i + 1; j < firsts.size(); j ++) {
+                        size_t merged = 0;
+                        for (size_t w = 0; w < 4; w ++)
+                            merged += __builtin_popcountll(seconds[i][w] | seconds[j][w]);
+                        const size_t cost = merged * (nfirsts[i] + nfirsts[j])
+                            - nseconds[i] * nfirsts[i] - nseconds[j] * nfirsts[j];
+                        if (cost < best) {
+                            best = cost;
+                            a = i;
+                            b = j;
+                        }
+                    }
+                for (size_t w = 0; w < 4; w ++) {
+                    firsts[a][w] |= firsts[b][w];
+                    seconds[a][w] |= seconds[b][w];
+                }
+                nfirsts[a] = count(firsts[a]);
+                nseconds[a] = count(seconds[a]);
+                firsts.erase(firsts.begin() + b);
+                seconds.erase(seconds.begin() + b);
+                nfirsts.erase(nfirsts.begin() + b);
+                nseconds.erase(nseconds.begin() + b);
+            }
+            for (size_t bucket = 0; bucket < firsts.size(); bucket ++)
+                for (unsigned c = 0; c < 256; c ++) {
+                    const uint8_t bit = 1 << bucket;
+                    if ((firsts[bucket][c >> 6] >> (c & 63)) & 1) {
+                        lo0[c & 15] |= bit;
+                        hi0[c >> 4] |= bit;
+                    }
+                    if ((seconds[bucket][c >> 6] >> (c & 63)) & 1) {
+                        lo1[c & 15] |= bit;
+                        hi1[c >> 4] |= bit;
+                    }
+                }
+            for (uint8_t *mask : {lo0, hi0, lo1, hi1})
+                std::copy(mask, mask + 16, mask + 16);
+        }
+
+        static size_t scalarKernel(const Prefilter &pf, const unsigned char *data, size_t n) {
+            for (size_t i = 0; i < n; i ++)
+                if (pf.candidate(data, i, n))
+                    return i;
+            return n;
+        }
+
+#ifdef TERMGREP_X86_SIMD
+        //! Checks the candidates of a vector starting at 'i', in order
+        static inline bool check(const Prefilter &pf, const unsigned char *data,
+                size_t n, size_t i, uint32_t candidates, size_t &found) {
+            for (; candidates != 0; candidates &= candidates - 1) {
+                const size_t pos = i + __builtin_ctz(candidates);
+                if (pf.candidate(data, pos, n)) {
+                    found = pos;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        __attribute__((target("avx2")))
+        static size_t avx2Kernel(const Prefilter &pf, const unsigned char *data, size_t n) {
+            const __m256i lo0 = _mm256_loadu_si256((const __m256i *) pf.lo0),
+                hi0 = _mm256_loadu_si256((const __m256i *) pf.hi0),
+                lo1 = _mm256_loadu_si256((const __m256i *) pf.lo1),
+                hi1 = _mm256_loadu_si256((const __m256i *) pf.hi1),
+                nibble = _mm256_set1_epi8(0x0F), zero = _mm256_setzero_si256();
+            size_t i = 0, found;
+            // The second characters are read one byte further
+            for (; i + 33 <= n; i += 32) {
+                const __m256i v0 = _mm256_loadu_si256((const __m256i *) (data + i)),
+                    v1 = _mm256_loadu_si256((const __m256i *) (data + i + 1));
+                const __m256i m0 = _mm256_and_si256(
+                    _mm256_shuffle_epi8(lo0, _mm256_and_si256(v0, nibble)),
+                    _mm256_shuffle_epi8(hi0, _mm256_and_si256(_mm256_srli_epi16(v0, 4), nibble)));
+                const __m256i m1 = _mm256_and_si256(
+                    _mm256_shuffle_epi8(lo1, _mm256_and_si256(v1, nibble)),
+                    _mm256_shuffle_epi8(hi1, _mm256_and_si256(_mm256_srli_epi16(v1, 4), nibble)));
+                const uint32_t candidates = ~(uint32_t) _mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(_mm256_and_si256(m0, m1), zero));
+                if (candidates != 0 && check(pf, data, n, i, candidates, found))
+                    return found;
+            }
+            return i + scalarKernel(pf, data + i, n - i);
+        }
+
+        __attribute__((target("ssse3")))
+        static size_t ssse3Kernel(const Prefilter &pf, const unsigned char *data, size_t n) {
+            const __m128i lo0 = _mm_loadu_si128((const __m128i *) pf.lo0),
+                hi0 = _mm_loadu_si128((const __m128i *) pf.hi0),
+                lo1 = _mm_loadu_si128((const __m128i *) pf.lo1),
+                hi1 = _mm_loadu_si128((const __m128i *) pf.hi1),
+                nibble = _mm_set1_epi8(0x0F), zero = _mm_setzero_si128();
+            size_t i = 0, found;
+            for (; i + 17 <= n; i += 16) {
+                const __m128i v0 = _mm_loadu_si128((const __m128i *) (data + i)),
+                    v1 = _mm_loadu_si128((const __m128i *) (data + i + 1));
+                const __m128i m0 = _mm_and_si128(
+                    _mm_shuffle_epi8(lo0, _mm_and_si128(v0, nibble)),
+                    _mm_shuffle_epi8(hi0, _mm_and_si128(_mm_srli_epi16(v0, 4), nibble)));
+                const __m128i m1 = _mm_and_si128(
+                    _mm_shuffle_epi8(lo1, _mm_and_si128(v1, nibble)),
+                    _mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(v1, 4), nibble)));
+                const uint32_t candidates = 0xFFFF & ~(uint32_t) _mm_movemask_epi8(
+                    _mm_cmpeq_epi8(_mm_and_si128(m0, m1), zero));
+                if (candidates != 0 && check(pf, data, n, i, candidates, found))
+                    return found;
+            }
+            return i + scalarKernel(pf, data + i, n - i);
+        }
+#endif
+    };
+}
@@ -0,0 +1,182 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace termgrep {
+
+    /*!
+     * \brief Scans the documents of a server connection, one at a time. The
+     * document of a request is fed as it arrives, between begin() and end(),
+     * which returns the response line (without its newline). Requests that
+     * update the term list go to addTerm() and removeTerm() instead.
+     */
+    class RequestHandler {
+    public:
+        virtual ~RequestHandler() {}
+        virtual void begin() = 0;
+        virtual void feed(const char *data, size_t size) = 0;
+        virtual std::string end(const std::string &id) = 0;
+        virtual std::string addTerm(const std::string &term, const std::string &id) = 0;
+        virtual std::string removeTerm(unsigned long long column, const std::string &id) = 0;
+    };
+
+    /*!
+     * \brief Serves the requests read from 'in' until its end, writing the
+     * responses to 'out'. A request is a header line "<length> [<id>]"
+     * followed by 'length' bytes of document, and gets one line back, in
+     * order. A header "+<length> [<id>]" is followed by a term to add
+     * instead, and "-<column> [<id>]" removes one. Returns false, after
+     * responding {"error": ...} if it still can, on a malformed request or
+     * an I/O error.
+     */
+    inline bool serveStream(int in, int out, RequestHandler &handler) {
+        std::vector<char> buf(1 << 16);
+        size_t begin = 0, end = 0;
+        auto fill = [&]() -> bool {
+            if (begin == end)
+                begin = end = 0;
+            while (true) {
+                ssize_t got = ::read(in, buf.data() + end, buf.size() - end);
+                if (got < 0 && errno == EINTR)
+                    continue;
+                if (got <= 0)
+                    return false;
+                end += got;
+                return true;
+            }
+        };
+        auto send = [&](const std::string &line) -> bool {
+            std::string data = line + '\n';
+            for (size_t off = 0; off < data.size(); ) {
+                ssize_t put = ::write(out, data.data() + off, data.size() - off);
+                if (put < 0 && errno == EINTR)
+                    continue;
+                if (put <= 0)
+                    return false;
+                off += put;
+            }
+            return true;
+        };
+        auto fail = [&](const std::string &msg) {
+            send("{\"error\":\"" + msg + "\"}");
+            return false;
+        };
+        while (true) {
+            // Header line, which is at most as long as the buffer
+            size_t eol;
+            while ((eol = std::find(buf.data() + begin, buf.data() + end, '\n')
+                    - buf.data()) == end) {
+                if (end == buf.size()) {
+                    if (begin == 0)
+                        return fail("request header too long");
+                    std::copy(buf.data() + begin, buf.data() + end, buf.data());
+                    end -= begin;
+                    begin = 0;
+                }
+                if (!fill())
+                    return begin == end || fail("incomplete request header");
+            }
+            std::string header(buf.data() + begin, eol - begin);
+            begin = eol + 1;
+            const char op = header.empty() ? 0 : header[0];
+            const char *number = header.c_str() + (op == '+' || op == '-');
+            char *idStart;
+            errno = 0;
+            unsigned long long length = strtoull(number, &idStart, 10);
+            if (!isdigit((unsigned char) number[0]) || errno != 0 ||
+                    (*idStart != 0 && *idStart != ' '))
+                return fail("malformed request header");
+            std::string id = *idStart == ' ' ? idStart + 1 : "";
+
+            if (op == '-') {
+                if (!send(handler.removeTerm(length, id)))
+                    return false;
+                continue;
+            }
+            if (op == '+') {
+                if (length > buf.size())
+                    return fail("term too long");
+                std::string term;
+                while (term.size() < length) {
+                    if (begin == end && !fill())
+                        return fail("incomplete term");
+                    size_t n = std::min<size_t>(length - term.size(), end - begin);
+                    term.append(buf.data() + begin, n);
+                    begin += n;
+                }
+                if (!send(handler.addTerm(term, id)))
+                    return false;
+                continue;
+            }
+
+            handler.begin();
+            while (length > 0) {
+                if (begin == end && !fill())
+                    return fail("incomplete document");
+                size_t n = std::min<unsigned long long>(length, end - begin);
+                handler.feed(buf.data() + begin, n);
+                begin += n;
+                length -= n;
+            }
+            if (!send(handler.end(id)))
+                return false;
+        }
+    }
+
+    /*!
+     * \brief Listens on the Unix socket 'path' and serves its connections
+     * with serveStream(), on 'workers' threads each with its own handler
+     * from makeHandler(). Never returns, but throws a runtime_error if the
+     * socket can't be set up.
+     */
+    inline void serveSocket(const std::string &path, size_t workers,
+            std::function<std::unique_ptr<RequestHandler>()> makeHandler) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw std::runtime_error("Socket path too long: "+ path);
+        strcpy(addr.sun_path, path.c_str());
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Can't create socket: ")+ strerror(errno));
+        ::unlink(path.c_str()); // Left over by a previous server
+        if (::bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0 ||
+                ::listen(fd, SOMAXCONN) < 0)
+            throw std::runtime_error("Can't listen on "+ path +": "+ strerror(errno));
+        // Clients going away mid-response must not kill the server
+        signal(SIGPIPE, SIG_IGN);
+
+        auto worker = [&]() {
+            auto handler = makeHandler();
+            while (true) {
+                int conn = ::accept(fd, nullptr, nullptr);
+                if (conn < 0) {
+                    // Out of descriptors, most likely: wait for some to close
+                    if (errno != EINTR)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    continue;
+                }
+                serveStream(conn, conn, *handler);
+                ::close(conn);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers; i ++)
+            threads.emplace_back(worker);
+        worker();
+    }
+}
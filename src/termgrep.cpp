@@ -1,6 +1,21 @@
 #include <set>
+#include <map>
 #include <locale>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "termgrep.hpp"
+#include "unicodetables.hpp"
+#include "prefilter.hpp"
 
 using namespace std;
 using namespace gvpp;
@@ -12,10 +27,6 @@ using namespace gvpp;
 #define CheckFuncT CheckFunc<CharType>
 #define StateT AbstractFSM<CharType>::State
 #define StateTN typename StateT
-#define StatePtrT AbstractFSM<CharType>::StatePtr
-#define StatePtrTN typename StatePtrT
-#define NextStateT AbstractFSM<CharType>::NextState
-#define NextStateTN typename NextStateT
 
 namespace termgrep {
 	template<class CType = DefaultCharType>
@@ -46,29 +57,17 @@ namespace termgrep {
 
 	template<class CharType>
 	basic_ostream<CharType> &operator<<(basic_ostream<CharType> &os, const StateTN &st) {
-		os << "State{"<<
-		        "id: "<< st.id;
-		if (st.chr != (CharType) 0)
-			os << ", chr: '" << st.chr << "'";
+		os << "State{";
+		if (!st.isfunc())
+			os << "chr: '" << st.chr << "'";
 		else
-			os << ", func: " << st.func.label;
+			os << "func: " << st.func - 1;
 		if (st.termid != 0)
 			os << ", termid: " << st.termid;
 		os <<"}";
 		return os;
 	}
 
-	template<class CharType>
-	basic_ostream<CharType> &operator<<(basic_ostream<CharType> &os, const StatePtrTN &st) {
-		os << "*" << *st;
-		return os;
-	}
-
-	template<class CharType>
-	size_t nbNext(unique_ptr<NextStateTN> &ptr) {
-		return (ptr) ? nbNext(ptr->next) + 1 : 0;
-	}
-
 	template<class charT>
 	basic_string<charT> to_str(int val);
 
@@ -82,30 +81,50 @@ namespace termgrep {
 		return to_wstring(val);
 	}
 
-	template<class CharType>
-	inline bool matchesState(StateTN &st, CharType chr) {
-		return (!st.isfunc && st.chr == chr) ||
-		       (st.isfunc && st.func(chr));
-	}
-
 	template<class CharType>
 	size_t AbstractFSMT::addState(CharType chr) {
 		size_t id = states.size();
-		states.emplace_back(new StateT{id, chr, CheckFuncT(), false, 0, unique_ptr<NextState>()});
+		states.push_back(State{chr, 0, 0, NO_EDGE, NO_EDGE});
 		return id;
 	}
 
+	// States with the same function share its entry in 'funcs'
 	template<class CharType>
 	size_t AbstractFSMT::addState(CheckFuncT func) {
 		size_t id = states.size();
-		states.emplace_back(new StateT{id, (CharType) 0, func, true, 0, unique_ptr<NextState>()});
+		auto same = find(funcs.begin(), funcs.end(), func);
+		if (same == funcs.end())
+			same = funcs.insert(funcs.end(), func);
+		states.push_back(State{(CharType) 0, (uint32_t) (same - funcs.begin()) + 1,
+			0, NO_EDGE, NO_EDGE});
 		return id;
 	}
 
+	template<class CharType>
+	void AbstractFSMT::addEdge(uint32_t from, uint32_t to) {
+		const uint32_t id = edges.size();
+		edges.push_back(Edge{to, NO_EDGE});
+		State &st = states[from];
+		if (st.lastEdge == NO_EDGE)
+			st.firstEdge = id;
+		else
+			edges[st.lastEdge].next = id;
+		st.lastEdge = id;
+	}
+
+	template<class CharType>
+	void AbstractFSMT::releaseStates() {
+		vector<State>().swap(states);
+		vector<Edge>().swap(edges);
+		vector<CheckFuncT>().swap(funcs);
+	}
+
 #ifndef TERMGREP_NO_GVPP
 
 	template<class CharType>
 	unique_ptr<Graph<CharType>> AbstractFSMT::getGraph() {
+		if (states.empty())
+			throw runtime_error("The states to draw were released");
 		unique_ptr<Graph<CharType>> gptr(new Graph<CharType>());
 		Graph<CharType> &g = *gptr;
 		g.set(AttrType::GRAPH, CW("splines"), CW("line"))
@@ -123,23 +142,24 @@ namespace termgrep {
 					.set(CW("shape"), CW("doubleoctagon"))
 					.set(CW("fillcolor"), CW("\"#AAAAFF\""));
 		map<strtype, size_t> nodeDepth;
-		vector<Edge<CharType>*> edges;
+		vector<gvpp::Edge<CharType>*> graphEdges;
 		nodeDepth[root.getId()] = 0;
-		function<void(StatePtr, Node<CharType> &, size_t)> addRecurse =
-				[&](StatePtr cur, Node<CharType> &prev, size_t depth) -> void {
+		function<void(uint32_t, Node<CharType> &, size_t)> addRecurse =
+				[&](uint32_t id, Node<CharType> &prev, size_t depth) -> void {
+					const State &cur = states[id];
 					Node<CharType> *curNode = &root;
 					auto toLabel = [](CharType chr) -> strtype {
 						return strtype(CW("'")) + chr + strtype(CW("'"));
 					};
-					if (cur->id != 0) {
-						strtype label = cur->isfunc ?
-										cur->func.label :
-										toLabel(cur->chr);
-						if (cur->termid != 0) {
-							label = to_str<CharType>(cur->id) + CW(": ") + label;
-							curNode = &g.addNode(to_str<CharType>((int) cur->id),
+					if (id != 0) {
+						strtype label = cur.isfunc() ?
+										funcs[cur.func - 1].label :
+										toLabel(cur.chr);
+						if (cur.termid != 0) {
+							label = to_str<CharType>(id) + CW(": ") + label;
+							curNode = &g.addNode(to_str<CharType>((int) id),
 							                     label + CW("\\n") +
-							                     this->getTerm(cur->termid));
+							                     this->getTerm(cur.termid));
 							curNode->
 								 set(CW("shape"), CW("rect"))
 								 .set(CW("color"), CW("black"))
@@ -147,28 +167,28 @@ namespace termgrep {
 								 .set(CW("fixedsize"), CW("false"));
 						} else
 							curNode = &g.addNode(
-									to_str<CharType>((int) cur->id), label);
+									to_str<CharType>((int) id), label);
 
 						auto &ed = g.addEdge(prev, *curNode);
-						edges.push_back(&ed);
+						graphEdges.push_back(&ed);
 						nodeDepth.insert(make_pair(curNode->getId(), depth));
 					}
-					for (auto *nxt = cur->next.get(); nxt != nullptr; nxt = nxt->next.get()) {
-						auto nxtId = to_str<CharType>((int) nxt->state->id);
+					for (uint32_t e = cur.firstEdge; e != NO_EDGE; e = edges[e].next) {
+						auto nxtId = to_str<CharType>((int) edges[e].to);
 						if (!g.hasNode(nxtId))
-							addRecurse(nxt->state, *curNode, depth + 1);
+							addRecurse(edges[e].to, *curNode, depth + 1);
 						else {
 							auto &ed = g.addEdge(*curNode, g.getNode(nxtId));
-							edges.push_back(&ed);
+							graphEdges.push_back(&ed);
 							if (depth+1 < nodeDepth[g.getNode(nxtId).getId()]) {
 								nodeDepth[g.getNode(nxtId).getId()] = depth + 1;
 							}
 						}
 					}
 				};
-		addRecurse(this->getRoot(), root, 0);
+		addRecurse(0, root, 0);
 
-		for (auto edge : edges) {
+		for (auto edge : graphEdges) {
 			auto frDep = nodeDepth[edge->getFrom().getId()],
 				toDep = nodeDepth[edge->getTo().getId()];
 			if (frDep >= toDep)
@@ -182,110 +202,1246 @@ namespace termgrep {
 
 #endif
 
+	template<class CharType>
+	const strtype &AbstractFSMT::getTerm(size_t id) {
+		return terms[id];
+	}
+
+	static bool isUnicodeBoundary(uint32_t chr) {
+		auto it = upper_bound(begin(UNICODE_BOUNDARIES), end(UNICODE_BOUNDARIES), chr,
+			[](uint32_t c, const UnicodeRange &range) { return c < range.first; });
+		return it != begin(UNICODE_BOUNDARIES) && chr <= (it - 1)->last;
+	}
+
+	template<>
+	char CharClass<char>::fold(char chr) {
+		return (chr >= 'A' && chr <= 'Z') ? chr - 'A' + 'a' : chr;
+	}
+
+	template<>
+	bool CharClass<char>::isBoundary(char chr) {
+		return (unsigned char) chr < 0x80 && isUnicodeBoundary(chr);
+	}
+
+	template<>
+	const vector<char> &CharClass<char>::foldable() {
+		static const vector<char> upper = [] {
+			vector<char> chrs;
+			for (char chr = 'A'; chr <= 'Z'; chr ++)
+				chrs.push_back(chr);
+			return chrs;
+		}();
+		return upper;
+	}
+
+	template<>
+	wchar_t CharClass<wchar_t>::fold(wchar_t chr) {
+		const uint32_t c = chr;
+		auto it = upper_bound(begin(UNICODE_LOWERCASE), end(UNICODE_LOWERCASE), c,
+			[](uint32_t c, const UnicodeCaseRange &range) { return c < range.first; });
+		if (it == begin(UNICODE_LOWERCASE) || c > (-- it)->last ||
+				(c - it->first) % it->stride != 0)
+			return chr;
+		return (wchar_t) (c + it->delta);
+	}
+
+	template<>
+	bool CharClass<wchar_t>::isBoundary(wchar_t chr) {
+		return isUnicodeBoundary(chr);
+	}
+
+	template<>
+	const vector<wchar_t> &CharClass<wchar_t>::foldable() {
+		static const vector<wchar_t> upper = [] {
+			vector<wchar_t> chrs;
+			for (auto &range : UNICODE_LOWERCASE)
+				for (uint32_t c = range.first; c <= range.last; c += range.stride)
+					chrs.push_back(c);
+			return chrs;
+		}();
+		return upper;
+	}
+
+	template<class CharType>
+	CheckFunc<CharType> checkWordBoundary() {
+		return CheckFunc<CharType>(CW("\\\\b"), [](int c) -> bool {
+			return c == wordBoundary<CharType>() || CharClass<CharType>::isBoundary(c);
+		});
+	}
+
+	//! Length of the UTF-8 sequence starting with 'lead', 0 if it can't start one
+	static inline size_t utf8Length(unsigned char lead) {
+		return lead < 0x80 ? 1 : lead < 0xC2 ? 0 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 :
+			lead < 0xF5 ? 4 : 0;
+	}
+
+	static inline size_t utf8Length(uint32_t chr) {
+		return chr < 0x80 ? 1 : chr < 0x800 ? 2 : chr < 0x10000 ? 3 : 4;
+	}
+
+	//! Decodes the character at 'bytes', returns its length or 0 if invalid
+	template<class CharType>
+	static size_t utf8Decode(const CharType *bytes, uint32_t &chr) {
+		size_t len = utf8Length((unsigned char) bytes[0]);
+		if (len == 0)
+			return 0;
+		chr = len == 1 ? bytes[0] : (unsigned char) bytes[0] & (0x7F >> len);
+		for (size_t i = 1; i < len; i ++) {
+			if (((unsigned char) bytes[i] & 0xC0) != 0x80)
+				return 0;
+			chr = (chr << 6) | ((unsigned char) bytes[i] & 0x3F);
+		}
+		return len;
+	}
+
+	template<class CharType>
+	static basic_string<CharType> utf8Encode(uint32_t chr) {
+		basic_string<CharType> bytes;
+		size_t len = utf8Length(chr);
+		if (len == 1)
+			bytes.push_back(chr);
+		else {
+			bytes.push_back((0xF00 >> len) | (chr >> (6 * (len - 1))));
+			for (size_t i = len - 1; i -- > 0; )
+				bytes.push_back(0x80 | ((chr >> (6 * i)) & 0x3F));
+		}
+		return bytes;
+	}
+
+	/*!
+	 * \brief Byte automaton that classifies multibyte UTF-8 characters as
+	 * their bytes come, so that matching them needs no decoding: whether
+	 * they are word boundaries, and the lowercase form of those that fold
+	 * to another character, whatever its length. start[lead] is the state
+	 * after a lead byte (0 if the byte can't start a multibyte character),
+	 * and next[state * 64 + (byte & 0x3F)] the one after a continuation
+	 * byte, or DONE + code once the character is complete: code & 1 is set
+	 * for boundaries, and code >> 1 is 1 + the index of the lowercase form
+	 * in 'folds', or 0 if there is none. Prefixes followed by the same
+	 * codes share their state, which leaves a few hundred of them.
+	 */
+	struct Utf8Chars {
+		static const uint32_t DONE = 1 << 15;
+		uint16_t start[256];
+		vector<uint16_t> next;
+		vector<string> folds;
+
+		static const Utf8Chars &get() {
+			static const Utf8Chars chars;
+			return chars;
+		}
+	private:
+		map<vector<uint16_t>, uint16_t> rows;
+		map<uint32_t, uint32_t> foldIds;
+		// States with 1 to 3 continuation bytes to go before plain characters
+		uint16_t plain[4];
+		Utf8Chars();
+		// State after 'prefix', in a character of 'len' bytes with
+		// 'remaining' continuation bytes to go
+		uint16_t state(size_t len, size_t remaining, uint32_t prefix);
+	};
+
+	//! Whether a character in [first, last] is a boundary or has a lowercase form
+	static bool hasSpecialChars(uint32_t first, uint32_t last) {
+		for (auto &range : UNICODE_BOUNDARIES)
+			if (range.first <= last && range.last >= first)
+				return true;
+		for (auto &range : UNICODE_LOWERCASE)
+			if (range.first <= last && range.last >= first)
+				return true;
+		return false;
+	}
+
+	Utf8Chars::Utf8Chars() : next(64, 0) {
+		// Row 0 is unused, as state 0 means there is no character
+		for (size_t remaining = 1; remaining < 4; remaining ++) {
+			vector<uint16_t> row(64, remaining == 1 ? DONE : plain[remaining - 1]);
+			plain[remaining] = next.size() / 64;
+			rows.insert(make_pair(row, plain[remaining]));
+			next.insert(next.end(), row.begin(), row.end());
+		}
+		fill(begin(start), end(start), 0);
+		for (uint32_t lead = 0xC2; lead < 0xF5; lead ++) {
+			const size_t len = utf8Length((unsigned char) lead);
+			start[lead] = state(len, len - 1, lead & (0x7F >> len));
+		}
+		if (next.size() / 64 >= DONE || 2 * folds.size() + 3 >= DONE)
+			throw runtime_error("The UTF-8 character automaton is too large");
+	}
+
+	uint16_t Utf8Chars::state(size_t len, size_t remaining, uint32_t prefix) {
+		const size_t bits = 6 * remaining;
+		if (!hasSpecialChars(prefix << bits, ((prefix + 1) << bits) - 1))
+			return plain[remaining];
+		vector<uint16_t> row(64);
+		for (uint32_t byte = 0; byte < 64; byte ++) {
+			const uint32_t chr = (prefix << 6) | byte;
+			if (remaining > 1) {
+				row[byte] = state(len, remaining - 1, chr);
+				continue;
+			}
+			// Overlong forms stay plain characters
+			uint32_t code = 0;
+			if (utf8Length(chr) == len) {
+				code = isUnicodeBoundary(chr) ? 1 : 0;
+				const uint32_t lower = CharClass<wchar_t>::fold(chr);
+				if (lower != chr) {
+					auto ins = foldIds.insert(make_pair(lower, folds.size()));
+					if (ins.second)
+						folds.push_back(utf8Encode<char>(lower));
+					code |= (ins.first->second + 1) << 1;
+				}
+			}
+			row[byte] = DONE + code;
+		}
+		auto ins = rows.insert(make_pair(row, next.size() / 64));
+		if (ins.second)
+			next.insert(next.end(), row.begin(), row.end());
+		return ins.first->second;
+	}
+
+	/*!
+	 * \brief State after a multibyte character with the Utf8Chars 'code',
+	 * from 'state', once its bytes led 'step' to 'path': like a wchar_t, it
+	 * follows the character edges of its lowercase form if there are any,
+	 * or else the word boundary edge if it is one. Byte classes aren't
+	 * boundaries, so a path that ends on the root has no character edge:
+	 * targets never are the root, which has no incoming edge and, in UTF-8
+	 * mode, doesn't merge with other states (see minimizeRows()).
+	 */
+	template<class Table, class Step>
+	static uint32_t utf8Step(const Table &table, Step step, uint32_t state, uint32_t path,
+			uint32_t code) {
+		if (code >> 1 != 0) {
+			path = state;
+			for (char byte : Utf8Chars::get().folds[(code >> 1) - 1])
+				if ((path = step(path, table.classOf((unsigned char) byte))) == 0)
+					break;
+		}
+		if (path != 0)
+			return path;
+		return step(state, code & 1 ? Table::CLASS_BOUNDARY : Table::CLASS_OTHER);
+	}
+
+	template<class Table>
+	static uint32_t utf8Step(const Table &table, uint32_t state, uint32_t path,
+			uint32_t code) {
+		return utf8Step(table, [&table](uint32_t state, uint32_t cls) {
+			return table.step(state, cls);
+		}, state, path, code);
+	}
+
+	/*!
+	 * \brief Number of positions a term spans when it matches: in UTF-8 mode
+	 * a multibyte character counts as one, like an invalid byte.
+	 */
+	template<class CharType>
+	static size_t termLength(const strtype &term, bool utf8) {
+		if (!utf8)
+			return term.length();
+		size_t len = 0;
+		uint32_t chr;
+		for (size_t i = 0; i < term.length(); len ++) {
+			size_t bytes = utf8Decode(term.c_str() + i, chr);
+			i += bytes == 0 ? 1 : bytes;
+		}
+		return len;
+	}
+
+	/*!
+	 * \brief Whether 'term' has a word boundary character, whose edge
+	 * hides the word boundary edges of the other terms (see updateChecker()).
+	 */
+	template<class CharType>
+	static bool hasBoundaryChars(const strtype &term, bool utf8) {
+		uint32_t chr;
+		for (size_t i = 0; i < term.length(); ) {
+			size_t len = 0;
+			if (utf8 && (unsigned char) term[i] >= 0x80)
+				len = utf8Decode(term.c_str() + i, chr);
+			if (len > 1 ? isUnicodeBoundary(chr) : CharClass<CharType>::isBoundary(term[i]))
+				return true;
+			i += max<size_t>(len, 1);
+		}
+		return false;
+	}
+
+	template<class CharType>
+	void TermGrepT::needTrie() const {
+		if (this->states.empty())
+			throw runtime_error("The trie was released, terms can't be changed "
+				"and matchers can't be built anymore");
+	}
+
+	/*!
+	 * \brief Builds the trie again from the terms left, in the same order:
+	 * the states of a removed term don't end it anymore, but its character
+	 * edges would still hide the word boundary edges of the others.
+	 */
+	template<class CharType>
+	void TermGrepT::rebuildTrie() {
+		needTrie();
+		if (!staleTrie)
+			return;
+		auto started = chrono::steady_clock::now();
+		this->states.clear();
+		this->edges.clear();
+		this->funcs.clear();
+		this->addState((CharType)0);
+		for (size_t tid = 1; tid < _terms.size(); tid ++) {
+			termNodes[tid] = 0;
+			if (removedTerms[tid])
+				continue;
+			if (termBounds[tid])
+				addStates(0, (wordBoundary<CharType>()+ _terms[tid]
+					+wordBoundary<CharType>()).c_str(), tid);
+			else
+				addStates(0, _terms[tid].c_str(), tid);
+		}
+		staleTrie = false;
+		trieSeconds += chrono::duration<double>(
+			chrono::steady_clock::now() - started).count();
+	}
+
 	template<class CharType>
 	size_t TermGrepT::addTerm(strtype term, bool bound) {
+		needTrie();
+		auto started = chrono::steady_clock::now();
 		size_t tid = this->terms.size();
 		_terms.push_back(term);
+		termBounds.push_back(bound);
+		termNodes.push_back(0);
+		removedTerms.push_back(false);
+		if (boundaryCharTerm == 0 && hasBoundaryChars(term, utf8))
+			boundaryCharTerm = tid;
 		if (bound)
 			term = wordBoundary<CharType>()+ term +wordBoundary<CharType>();
-		if (term.length() > longestTerm)
-			longestTerm = term.length();
-		addStates(this->getRoot(), term.c_str());
+		if (termLength(term, utf8) > longestTerm)
+			longestTerm = termLength(term, utf8);
+		addStates(0, term.c_str(), tid);
+		trieSeconds += chrono::duration<double>(
+			chrono::steady_clock::now() - started).count();
 		return tid;
 	}
 
 	template<class CharType>
-	const strtype &AbstractFSMT::getTerm(size_t id) {
-		return terms[id];
+	void TermGrepT::addStates(uint32_t from, const CharType *chars, size_t termid) {
+		CharType chr = CharClass<CharType>::fold(chars[0]);
+
+		if (chr == (CharType) 0) {
+			this->states[from].termid = termid;
+			termNodes[termid] = from;
+			return;
+		}
+
+		uint32_t nextState;
+		size_t len = 0;
+		if (utf8 && (unsigned char) chr >= 0x80)
+			len = addMultibyte(from, chars, nextState);
+		if (len == 0) {
+			nextState = addChild(from, chr);
+			len = 1;
+		}
+		addStates(nextState, chars + len, termid);
 	}
 
 	template<class CharType>
-	CheckFunc<CharType> checkWordBoundary() {
-		locale loc;
-		return CheckFunc<CharType>(CW("\\\\b"), [loc](char c) -> bool {
-			return c == wordBoundary<CharType>() || isspace(c, loc) || ispunct(c, loc);
-		});
+	uint32_t TermGrepT::addChild(uint32_t from, CharType chr) {
+		for (uint32_t e = this->states[from].firstEdge; e != AbstractFSMT::NO_EDGE;
+				e = this->edges[e].next)
+			if (this->matches(this->states[this->edges[e].to], chr))
+				return this->edges[e].to;
+		uint32_t nextState = (chr == wordBoundary<CharType>()) ?
+			this->addState(checkWordBoundary<CharType>()) : this->addState(chr);
+		this->addEdge(from, nextState);
+		return nextState;
 	}
 
+	/*!
+	 * \brief Adds the lowercase form of the UTF-8 character at 'chars' after
+	 * 'from', byte by byte, whatever its length; Utf8Chars folds the input
+	 * the same way. Like a single character, it follows the first child that
+	 * matches it: a word boundary if it is one, or the start of a path
+	 * with all its bytes. Returns the length of the character, or 0 if it
+	 * isn't valid UTF-8.
+	 */
 	template<class CharType>
-	void TermGrepT::addStates(StatePtr from, const CharType *chars) {
-		CharType chr = tolower(chars[0]);
+	size_t TermGrepT::addMultibyte(uint32_t from, const CharType *chars, uint32_t &to) {
+		const uint32_t NONE = AbstractFSMT::NO_EDGE;
+		const auto &states = this->states;
+		const auto &edges = this->edges;
+		uint32_t chr;
+		size_t len = utf8Decode(chars, chr);
+		if (len == 0)
+			return 0;
+		const bool boundary = isUnicodeBoundary(chr);
+		const auto bytes = utf8Encode<CharType>(CharClass<wchar_t>::fold(chr));
+		for (uint32_t e = states[from].firstEdge; e != NONE; e = edges[e].next) {
+			if (states[edges[e].to].isfunc()) {
+				if (!boundary)
+					continue;
+				to = edges[e].to;
+				return len;
+			}
+			to = edges[e].to;
+			for (size_t i = 0; to != NONE && i < bytes.size(); i ++) {
+				if (i > 0) {
+					uint32_t child = states[to].firstEdge;
+					while (child != NONE && (states[edges[child].to].isfunc() ||
+							states[edges[child].to].chr != bytes[i]))
+						child = edges[child].next;
+					to = child != NONE ? edges[child].to : NONE;
+				} else if (states[to].chr != bytes[0])
+					to = NONE;
+			}
+			if (to != NONE)
+				return len;
+		}
+		to = from;
+		for (CharType byte : bytes)
+			to = addChild(to, byte);
+		return len;
+	}
 
-		if (chr == (CharType) 0) {
-			from->termid = this->terms.size() - 1;
+	template<class CharType>
+	bool TermGrepT::removeTerm(size_t termid) {
+		if (termid == 0 || termid >= _terms.size() || removedTerms[termid])
+			return false;
+		needTrie();
+		removedTerms[termid] = true;
+		removals ++;
+		staleTrie = true;
+		// Only the last duplicate of a term has its state: the previous
+		// one that remains, if any, takes it over
+		auto &node = this->states[termNodes[termid]];
+		if (node.termid == termid) {
+			node.termid = 0;
+			for (size_t tid = 1; tid < termid; tid ++)
+				if (termNodes[tid] == termNodes[termid] && !removedTerms[tid])
+					node.termid = tid;
+		}
+		return true;
+	}
+
+	struct IdVectorHash {
+		size_t operator()(const vector<uint32_t> &ids) const {
+			size_t hash = ids.size();
+			for (uint32_t id : ids)
+				hash ^= id + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+			return hash;
+		}
+	};
+
+	/*!
+	 * \brief Merges the equivalent states of the sparse rows built by
+	 * compile(), in place. Equivalence is refined Moore-style: states are
+	 * first split by termid, then blocks are split by the blocks their
+	 * transitions lead to, until no block splits anymore. A character edge
+	 * leading to the same block as the fallback for its class (the boundary
+	 * edge or the root) is the same transition as having no edge, so it
+	 * doesn't count and is dropped. The root stays state 0.
+	 *
+	 * In UTF-8 mode the root doesn't merge with anything: a multibyte path
+	 * ending on a state that behaves like the root is still a character
+	 * edge, which has precedence over the boundary one, while a path ending
+	 * on the root means there is none (see utf8Step()).
+	 */
+	static void minimizeRows(vector<uint32_t> &rowStart, vector<uint32_t> &labels,
+			vector<uint32_t> &targets, vector<uint32_t> &boundaryTarget,
+			vector<uint32_t> &termids, const TableArray<uint8_t> &classBoundary,
+			bool keepRoot) {
+		const size_t nstates = termids.size();
+		vector<uint32_t> block(nstates), nextBlock(nstates), blockSize;
+		unordered_map<vector<uint32_t>, uint32_t, IdVectorHash> blocks;
+		vector<uint32_t> sig;
+		auto split = [&](vector<uint32_t> &into, bool byTransitions) -> size_t {
+			blocks.clear();
+			uint32_t count = 0;
+			// The root comes first, so that its block is always 0
+			for (size_t st = 0; st < nstates; st ++) {
+				sig.clear();
+				if (!byTransitions) {
+					sig.push_back(termids[st]);
+					sig.push_back(keepRoot && st == 0);
+				} else if (blockSize[block[st]] == 1) {
+					into[st] = count ++; // Can't split any further
+					continue;
+				} else {
+					const uint32_t bound = block[boundaryTarget[st]], root = block[0];
+					sig.push_back(block[st]);
+					sig.push_back(bound);
+					for (uint32_t e = rowStart[st]; e < rowStart[st + 1]; e ++)
+						if (block[targets[e]] != (classBoundary[labels[e]] ? bound : root)) {
+							sig.push_back(labels[e]);
+							sig.push_back(block[targets[e]]);
+						}
+				}
+				auto ins = blocks.insert(make_pair(sig, count));
+				if (ins.second)
+					count ++;
+				into[st] = ins.first->second;
+			}
+			blockSize.assign(count, 0);
+			for (size_t st = 0; st < nstates; st ++)
+				blockSize[into[st]] ++;
+			return count;
+		};
+		size_t nblocks = split(block, false);
+		while (true) {
+			size_t count = split(nextBlock, true);
+			block.swap(nextBlock);
+			if (count == nblocks)
+				break;
+			nblocks = count;
+		}
+		blocks.clear();
+		if (nblocks == nstates)
 			return;
+
+		// Each block keeps the row of its first state
+		vector<uint32_t> firstState(nblocks);
+		for (size_t st = nstates; st -- > 0; )
+			firstState[block[st]] = st;
+		vector<uint32_t> newRowStart(1, 0), newLabels, newTargets,
+			newBoundary(nblocks, 0), newTermids(nblocks, 0);
+		for (uint32_t b = 0; b < nblocks; b ++) {
+			const uint32_t st = firstState[b];
+			newTermids[b] = termids[st];
+			newBoundary[b] = block[boundaryTarget[st]];
+			for (uint32_t e = rowStart[st]; e < rowStart[st + 1]; e ++) {
+				const uint32_t to = block[targets[e]];
+				if (to != (classBoundary[labels[e]] ? newBoundary[b] : 0)) {
+					newLabels.push_back(labels[e]);
+					newTargets.push_back(to);
+				}
+			}
+			newRowStart.push_back(newLabels.size());
+		}
+		rowStart.swap(newRowStart);
+		labels.swap(newLabels);
+		targets.swap(newTargets);
+		boundaryTarget.swap(newBoundary);
+		termids.swap(newTermids);
+	}
+
+	/*!
+	 * \brief Sets the character classes of 'table' from the edge labels of
+	 * 'states', and lists the sparse rows of these states, linked by 'edges'.
+	 */
+	template<class CharType>
+	void TermGrepT::Matcher::buildRows(Table &table, const vector<StateTN> &states,
+			const vector<typename AbstractFSMT::Edge> &edges, bool utf8,
+			vector<uint32_t> &rowStart, vector<uint32_t> &labels,
+			vector<uint32_t> &targets, vector<uint32_t> &boundaryTarget,
+			vector<uint32_t> &termids) {
+		const size_t nstates = states.size();
+		typedef CharClass<CharType> Classes;
+
+		// One class per distinct edge label, after the two shared ones
+		vector<CharType> alphabet;
+		for (size_t id = 1; id < nstates; id ++)
+			if (!states[id].isfunc())
+				alphabet.push_back(states[id].chr);
+		sort(alphabet.begin(), alphabet.end());
+		alphabet.erase(unique(alphabet.begin(), alphabet.end()), alphabet.end());
+		table.utf8 = utf8;
+		table.nclasses = Table::CLASS_BOUNDARY + 1 + alphabet.size();
+		vector<uint8_t> classBoundary(table.nclasses, false);
+		vector<typename Table::WideClass> wideClass;
+		classBoundary[Table::CLASS_BOUNDARY] = true;
+		for (size_t i = 0; i < alphabet.size(); i ++) {
+			uint32_t cls = Table::CLASS_BOUNDARY + 1 + i;
+			classBoundary[cls] = Classes::isBoundary(alphabet[i]);
+			if ((typename Table::UCharType) alphabet[i] >= Table::LOW_CHARS)
+				wideClass.push_back({alphabet[i], cls});
+		}
+		auto foldedClass = [&](CharType chr) -> uint32_t {
+			auto it = lower_bound(alphabet.begin(), alphabet.end(), chr);
+			if (it != alphabet.end() && *it == chr)
+				return Table::CLASS_BOUNDARY + 1 + (it - alphabet.begin());
+			return Classes::isBoundary(chr) ? Table::CLASS_BOUNDARY : Table::CLASS_OTHER;
+		};
+		vector<uint32_t> lowClass(Table::LOW_CHARS);
+		for (size_t c = 0; c < Table::LOW_CHARS; c ++)
+			lowClass[c] = foldedClass(Classes::fold((CharType) c));
+		// Wide characters aren't folded while scanning: the ones folding to
+		// a character of the alphabet get an entry of their own
+		for (CharType chr : Classes::foldable()) {
+			uint32_t cls = foldedClass(Classes::fold(chr));
+			if ((typename Table::UCharType) chr >= Table::LOW_CHARS &&
+					cls > Table::CLASS_BOUNDARY)
+				wideClass.push_back({chr, cls});
 		}
+		sort(wideClass.begin(), wideClass.end());
+		table.classBoundary = move(classBoundary);
+		table.wideClass = move(wideClass);
+		table.lowClass = move(lowClass);
 
-		StatePtr nextState;
-		for (auto *nxt = from->next.get(); nxt; nxt = nxt->next.get()) {
-			if (matchesState<>(*nxt->state, chr)) {
-				nextState = nxt->state;
+		rowStart.assign(1, 0);
+		labels.clear();
+		targets.clear();
+		boundaryTarget.assign(nstates, 0);
+		termids.assign(nstates, 0);
+		vector<pair<uint32_t, uint32_t>> row;
+		for (size_t id = 0; id < nstates; id ++) {
+			row.clear();
+			for (uint32_t e = states[id].firstEdge; e != AbstractFSMT::NO_EDGE; e = edges[e].next) {
+				const uint32_t to = edges[e].to;
+				if (states[to].isfunc())
+					boundaryTarget[id] = to;
+				else
+					row.emplace_back(foldedClass(states[to].chr), to);
+			}
+			sort(row.begin(), row.end());
+			for (auto &edge : row) {
+				labels.push_back(edge.first);
+				targets.push_back(edge.second);
+			}
+			rowStart.push_back(labels.size());
+			termids[id] = states[id].termid;
+		}
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::compile() {
+		shared_ptr<Table> tableptr(new Table());
+		Table &table = *tableptr;
+		vector<uint32_t> rowStart, labels, targets, boundaryTarget, termids;
+		buildRows(table, this->states, this->edges, grep.utf8, rowStart, labels, targets,
+			boundaryTarget, termids);
+		minimizeRows(rowStart, labels, targets, boundaryTarget, termids,
+			table.classBoundary, table.utf8);
+		const size_t nstates = termids.size();
+		buildStats.minimizedStates = nstates;
+		buildStats.minimizedEdges = labels.size()
+			+ count_if(boundaryTarget.begin(), boundaryTarget.end(),
+				[](uint32_t to) { return to != 0; });
+		table.rowStart = move(rowStart);
+		table.labels = move(labels);
+		table.targets = move(targets);
+		table.boundaryTarget = move(boundaryTarget);
+		table.termids = move(termids);
+		addDenseRows(table, true);
+		this->table = tableptr;
+	}
+
+	/*!
+	 * \brief Fills the dense rows of 'table' from its sparse ones, so it must
+	 * be complete otherwise: for all states if 'all' and they fit in
+	 * MAX_DENSE_CELLS, else for the root and the high fan-out states.
+	 */
+	template<class CharType>
+	void TermGrepT::Matcher::addDenseRows(Table &table, bool all) {
+		const size_t nstates = table.termids.size();
+		const bool allDense = all && nstates * table.nclasses <= Table::MAX_DENSE_CELLS;
+		size_t ndense = 0;
+		vector<uint32_t> denseRow(nstates, Table::NO_ROW), dense;
+		for (size_t st = 0; st < nstates; st ++) {
+			if (!allDense && st != 0 &&
+					table.rowStart[st + 1] - table.rowStart[st] < Table::DENSE_FANOUT)
+				continue;
+			if ((ndense + 1) * table.nclasses > Table::MAX_DENSE_CELLS)
 				break;
+			dense.resize((ndense + 1) * table.nclasses);
+			for (uint32_t cls = 0; cls < table.nclasses; cls ++)
+				dense[ndense * table.nclasses + cls] = table.sparseStep(st, cls);
+			denseRow[st] = ndense ++;
+		}
+		table.denseRow = move(denseRow);
+		table.dense = move(dense);
+	}
+
+	template<class CharType>
+	size_t TermGrepT::Matcher::Table::bytes() const {
+		return lowClass.size() * sizeof(uint32_t)
+			+ wideClass.size() * sizeof(WideClass)
+			+ classBoundary.size() * sizeof(uint8_t)
+			+ (rowStart.size() + labels.size() + targets.size()
+				+ boundaryTarget.size() + denseRow.size() + dense.size()
+				+ termids.size() + fail.size()) * sizeof(uint32_t);
+	}
+
+	/*!
+	 * Besides the bounds of the arrays, failure links must all lead back to
+	 * the root, or sparseStep() would loop on them. The dense rows can't
+	 * exceed MAX_DENSE_CELLS either, as they are indexed in 32 bits.
+	 */
+	template<class CharType>
+	bool TermGrepT::Matcher::Table::valid(size_t nterms) const {
+		const size_t nstates = termids.size(), nedges = labels.size();
+		if (nstates == 0 || nclasses < 2 || lowClass.size() != LOW_CHARS ||
+				classBoundary.size() != nclasses || rowStart.size() != nstates + 1 ||
+				targets.size() != nedges || boundaryTarget.size() != nstates ||
+				denseRow.size() != nstates || dense.size() % nclasses != 0 ||
+				dense.size() > MAX_DENSE_CELLS ||
+				(fail.size() != 0 && fail.size() != nstates))
+			return false;
+		for (uint32_t cls : lowClass)
+			if (cls >= nclasses)
+				return false;
+		for (auto &wc : wideClass)
+			if (wc.cls >= nclasses)
+				return false;
+		if (rowStart[0] != 0 || rowStart[nstates] != nedges)
+			return false;
+		for (size_t st = 0; st < nstates; st ++)
+			if (rowStart[st] > rowStart[st + 1] || boundaryTarget[st] >= nstates ||
+					termids[st] >= nterms ||
+					(denseRow[st] != NO_ROW && denseRow[st] >= dense.size() / nclasses))
+				return false;
+		for (const TableArray<uint32_t> *to : {&targets, &dense, &fail})
+			for (uint32_t st : *to)
+				if (st >= nstates)
+					return false;
+		// 1 while following the links from a state, 2 once they reached the root
+		vector<uint8_t> reached(fail.size(), 0);
+		vector<uint32_t> path;
+		for (size_t st = 1; st < fail.size(); st ++) {
+			uint32_t link = st;
+			for (; link != 0 && reached[link] == 0; link = fail[link]) {
+				reached[link] = 1;
+				path.push_back(link);
 			}
+			if (link != 0 && reached[link] == 1)
+				return false;
+			for (uint32_t on : path)
+				reached[on] = 2;
+			path.clear();
 		}
-		if (nextState == nullptr) {
-			auto tid = (chr == wordBoundary<CharType>()) ? this->addState(checkWordBoundary<CharType>()) :
-					this->addState(chr);
-			nextState = this->states[tid];
-			//from->next->push_back(nextState);
-			unique_ptr<NextStateTN> *last = &from->next;
-			while (*last)
-				last = &(*last)->next;
-			last->reset(new NextStateTN{nextState, unique_ptr<NextStateTN>()});
+		return true;
+	}
+
+	template<class CharType>
+	uint32_t TermGrepT::Matcher::Table::wideClassOf(CharType chr) const {
+		auto it = lower_bound(wideClass.begin(), wideClass.end(),
+				WideClass{chr, 0});
+		if (it != wideClass.end() && it->chr == chr)
+			return it->cls;
+		return CharClass<CharType>::isBoundary(chr) ? CLASS_BOUNDARY : CLASS_OTHER;
+	}
+
+	template<class CharType>
+	uint32_t TermGrepT::Matcher::Table::sparseStep(uint32_t state, uint32_t cls,
+			bool boundary) const {
+		for (uint32_t st = state; ; st = fail[st]) {
+			auto first = labels.begin() + rowStart[st],
+				last = labels.begin() + rowStart[st + 1];
+			auto it = lower_bound(first, last, cls);
+			if (it != last && *it == cls)
+				return targets[it - labels.begin()];
+			if (st == 0 || fail.size() == 0)
+				break;
 		}
+		// Character edges take precedence over the word-boundary edge
+		uint32_t bound = boundaryTarget[state];
+		if (bound != 0 && boundary)
+			return bound;
+		return 0; // No matching transition = return to root
+	}
 
-		addStates(nextState, chars + 1);
+	template<class CharType>
+	size_t TermGrepT::Matcher::LazyTable::SetHash::operator()(
+			const vector<uint32_t> &ids) const {
+		return IdVectorHash()(ids);
 	}
 
 	template<class CharType>
-	void TermGrepT::Matcher::feed(CharType chr) {
-		chr = tolower(chr);
-		StatePtr nextState;
-		for (auto *nxt = curstate->next.get(); nxt; nxt = nxt->next.get())
-			if (matchesState<CharType>(*nxt->state, chr))
-				nextState = nxt->state;
-		if (nextState != nullptr) {
-			curstate = nextState;
-		} else // No matching transition = return to root
-			curstate = this->getRoot();
-		if (curstate->termid != 0) {
-			auto startPos = curPos - this->getTerm(curstate->termid).length() + 1;
-			candidates.remove_if([&](const Match &m)
-					{ return m.startPos >= startPos; });
-			candidates.push_back(Match(curstate->termid,
-						startPos, this->getTerm(curstate->termid)));
-			// out() << "Candidate match : "<< candidates.back().term
-			// 		<< "("<< candidates.back().termid <<")" << endl;
-			if (nextCheck == 0)
-				nextCheck = longestTerm;
-		}
-		if (nextCheck > 0 && --nextCheck == 0) {
-			auto candit = candidates.begin();
-			while (candit != candidates.end()) {
-				if (curPos - candit->startPos >= longestTerm) {
-					auto accepted = candit++; // Store iterator then  move it on
-					// out<CharType>() << "Validating match : "<< accepted->term << endl;
-					matches.splice(matches.end(), candidates,
-									accepted, next(accepted));
-				} else
-					candit ++;
+	TermGrepT::Matcher::LazyTable::LazyTable(shared_ptr<const Table> nfa,
+			size_t maxBytes, const vector<strtype> &terms) :
+			nfa(nfa), maxBytes(maxBytes), nclasses(nfa->nclasses) {
+		for (auto &term : terms)
+			termLengths.push_back(termLength(term, nfa->utf8));
+		clear();
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::LazyTable::clear() {
+		sets.clear();
+		interned.clear();
+		termids.clear();
+		vector<uint32_t>().swap(rows);
+		bytes = 0;
+		intern(vector<uint32_t>(1, 0));
+		if (bypass)
+			for (auto set : {&scratch, &kept}) {
+				sets.push_back(set);
+				termids.push_back(0);
+				rows.resize(rows.size() + nclasses, UNKNOWN);
 			}
-			nextCheck = (candidates.size() > 0) ? longestTerm : 0;
+	}
+
+	// Like the eager construction, see Matcher(TermGrep &)
+	template<class CharType>
+	uint32_t TermGrepT::Matcher::LazyTable::longestTerm(const vector<uint32_t> &set) const {
+		uint32_t termid = 0;
+		size_t termlen = 0;
+		for (uint32_t node : set) {
+			const uint32_t tid = nfa->termids[node];
+			if (tid != 0 && termLengths[tid] > termlen) {
+				termid = tid;
+				termlen = termLengths[tid];
+			}
+		}
+		return termid;
+	}
+
+	template<class CharType>
+	uint32_t TermGrepT::Matcher::LazyTable::intern(const vector<uint32_t> &set) {
+		auto found = interned.find(set);
+		if (found != interned.end())
+			return found->second;
+		const uint32_t id = sets.size();
+		auto ins = interned.insert(make_pair(set, id));
+		sets.push_back(&ins.first->first);
+		termids.push_back(longestTerm(set));
+		rows.resize(rows.size() + nclasses, UNKNOWN);
+		bytes += set.size() * sizeof(uint32_t) + sizeof(set) + 4 * sizeof(void *)
+			+ nclasses * sizeof(uint32_t) + sizeof(uint32_t);
+		return id;
+	}
+
+	/*!
+	 * The next set holds the targets of the character edges for 'cls' of
+	 * the set's states and of the root, implicitly part of every set. Like
+	 * in the compiled table, the word boundary edges are only followed when
+	 * there are none.
+	 */
+	template<class CharType>
+	uint32_t TermGrepT::Matcher::LazyTable::miss(uint32_t state, uint32_t cls) {
+		const vector<uint32_t> &from = *sets[state];
+		next.clear();
+		for (uint32_t node : from)
+			if (uint32_t to = nfa->sparseStep(node, cls, false))
+				next.push_back(to);
+		if (from.front() != 0)
+			if (uint32_t to = nfa->sparseStep(0, cls, false))
+				next.push_back(to);
+		if (next.empty() && nfa->classBoundary[cls]) {
+			for (uint32_t node : from)
+				if (nfa->boundaryTarget[node] != 0)
+					next.push_back(nfa->boundaryTarget[node]);
+			if (from.front() != 0 && nfa->boundaryTarget[0] != 0)
+				next.push_back(nfa->boundaryTarget[0]);
+		}
+		sort(next.begin(), next.end());
+		next.erase(unique(next.begin(), next.end()), next.end());
+		if (bypass) {
+			if (next.empty())
+				return 0;
+			scratch.swap(next);
+			termids[SCRATCH] = longestTerm(scratch);
+			return SCRATCH;
+		}
+		const uint32_t to = next.empty() ? 0 : intern(next);
+		rows[(size_t) state * nclasses + cls] = to;
+		return to;
+	}
+
+	template<class CharType>
+	uint32_t TermGrepT::Matcher::LazyTable::keep(uint32_t state) {
+		if (!bypass || state != SCRATCH)
+			return state;
+		kept = scratch;
+		termids[KEPT] = termids[SCRATCH];
+		return KEPT;
+	}
+
+	template<class CharType>
+	uint32_t TermGrepT::Matcher::LazyTable::adopt(const vector<uint32_t> &set) {
+		if (set.size() == 1 && set[0] == 0)
+			return 0;
+		if (!bypass)
+			return intern(set);
+		scratch = set;
+		termids[SCRATCH] = longestTerm(scratch);
+		return SCRATCH;
+	}
+
+	template<class CharType>
+	uint32_t TermGrepT::Matcher::LazyTable::flush(uint32_t keep, size_t curPos) {
+		const vector<uint32_t> kept = *sets[keep];
+		if (sinceFlush + curPos - flushPos < THRASH_CHARS * sets.size())
+			bypass = true;
+		flushes ++;
+		sinceFlush = 0;
+		flushPos = curPos;
+		clear();
+		return adopt(kept);
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::LazyTable::restart(size_t endPos) {
+		sinceFlush += endPos - flushPos;
+		flushPos = 0;
+		if (bypass) {
+			bypass = false;
+			clear();
+		}
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::feed(CharType chr) {
+		if (utf8Chars && ((typename Table::UCharType) chr >= 0x80 || charCode != 0)) {
+			feedMultibyte(chr);
+			return;
+		}
+		step(chr);
+		advance();
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::advance() {
+		size_t termid = lazy ? lazy->termids[curstate] : table->termids[curstate];
+		if (overlay)
+			termid = overlaid(termid);
+		// Candidates this old can't be overlapped by a new one anymore
+		while (candHead != candTail &&
+				curPos - candidates[candHead & candMask].startPos >= longestTerm)
+			accept(candidates[candHead ++ & candMask]);
+		if (termid != 0) {
+			auto startPos = curPos - termLengths[termid] + 1;
+			if (startPos < earliestStart)
+				earliestStart = startPos;
+			while (candTail != candHead &&
+					candidates[(candTail - 1) & candMask].startPos >= startPos)
+				candTail --;
+			Candidate &cand = candidates[candTail ++ & candMask];
+			cand.termid = termid;
+			cand.startPos = startPos;
+			// Byte positions, like those of a plain char matcher, for matches
+			cand.matchPos = utf8Chars && keepMatches ? byteOffset(startPos) + 1 : startPos;
+			if (sink)
+				setSpan(cand);
 		}
 		curPos ++;
 	}
 
+	/*!
+	 * Positions count the tab that reset() feeds first, and bounded terms
+	 * are only accepted on the boundary that follows them. A boundary the
+	 * term starts or ends with can be one of the tabs around the input,
+	 * which the span is then cut to. The span is set as the candidate is
+	 * found, while the bytes of its characters are still in the ring.
+	 */
+	template<class CharType>
+	void TermGrepT::Matcher::setSpan(Candidate &cand) const {
+		const size_t length = termLengths[cand.termid],
+			end = cand.startPos + length - 1 - termBounded[cand.termid],
+			start = end >= length ? end - length : 0;
+		cand.spanStart = utf8Chars ? byteOffset(start + 1) : start;
+		cand.spanEnd = utf8Chars ? byteOffset(min(end, inputEnd) + 1) : min(end, inputEnd);
+	}
+
+	template<class CharType>
+	size_t TermGrepT::Matcher::byteOffset(size_t pos) const {
+		const size_t oldest = charBytesCount - min(charBytesCount, candMask + 1);
+		size_t i = charBytesCount;
+		while (i > oldest && charBytes[(i - 1) & candMask].pos >= pos)
+			i --;
+		return pos - 1 + (i > oldest ? charBytes[(i - 1) & candMask].extra : floorExtra);
+	}
+
+	/*!
+	 * A multibyte character takes a single position, and matches like a
+	 * wchar_t would: it follows the character edges of its lowercase form if
+	 * there is a path for all its bytes, otherwise the word boundary edge if
+	 * it is one, or returns to the root. Its bytes are stepped through the
+	 * table's rows and through Utf8Chars as they come, which tells once the
+	 * character is complete whether that path counts. Bytes that aren't part
+	 * of a valid sequence take a position each, and truncated sequences one.
+	 */
+	template<class CharType>
+	void TermGrepT::Matcher::feedMultibyte(CharType chr) {
+		const unsigned char byte = chr;
+		if (charCode != 0) {
+			if ((byte & 0xC0) == 0x80) {
+				step(chr);
+				extraBytes ++;
+				charCode = utf8Chars->next[charCode * 64 + (byte & 0x3F)];
+				if (charCode >= Utf8Chars::DONE)
+					endChar();
+				return;
+			}
+			abandonChar();
+		}
+		charCode = utf8Chars->start[byte];
+		if (charCode == 0) {
+			step(chr);
+			advance();
+			return;
+		}
+		charState = lazy ? lazy->keep(curstate) : curstate;
+		charAdded = addedState;
+		step(chr);
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::endChar() {
+		const uint32_t code = charCode - Utf8Chars::DONE;
+		charCode = 0;
+		// Most characters complete a path and have no lowercase form
+		const bool folds = code >> 1 != 0;
+		if (folds || curstate == 0) {
+			LazyTable *lz = lazy.get();
+			curstate = lz ? utf8Step(*table, [lz](uint32_t state, uint32_t cls) {
+				return lz->step(state, cls);
+			}, charState, curstate, code) : utf8Step(*table, charState, curstate, code);
+		}
+		if (lazy && lazy->full())
+			curstate = lazy->flush(curstate, curPos);
+		if (added && (folds || addedState == 0))
+			addedState = utf8Step(*added, charAdded, addedState, code);
+		CharBytes &last = charBytes[charBytesCount ++ & candMask];
+		if (charBytesCount > candMask + 1)
+			floorExtra = last.extra;
+		last = CharBytes{curPos, extraBytes};
+		advance();
+	}
+
+	// A truncated character matches nothing, like an invalid byte
+	template<class CharType>
+	void TermGrepT::Matcher::abandonChar() {
+		curstate = addedState = 0;
+		charCode = Utf8Chars::DONE;
+		endChar();
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::feedParallel(const CharType *chrs, size_t n,
+			size_t nthreads) {
+		// Below this, a chunk isn't worth a thread and the warm-up dominates
+		const size_t warmup = 4 * longestTerm, minChunk = max<size_t>(1 << 16, 4 * warmup);
+		size_t nchunks = min(nthreads, n / minChunk);
+		if (nchunks <= 1) {
+			feed(chrs, n);
+			return;
+		}
+		const size_t chunkLen = n / nchunks, basePos = curPos;
+		// Gives the helpers byte offsets from where they start, like ours
+		const size_t baseExtra = extraBytes + (charCode != 0 ? 1 : 0);
+		// In UTF-8 mode chunks start on a character, not inside one, and a
+		// character cut by the end of the input is left for us to feed
+		vector<size_t> bounds(nchunks + 1, n);
+		for (size_t k = 0; k < nchunks; k ++) {
+			bounds[k] = k * chunkLen;
+			while (utf8Chars && bounds[k] > 0 && bounds[k] < n &&
+					((typename Table::UCharType) chrs[bounds[k]] & 0xC0) == 0x80)
+				bounds[k] ++;
+		}
+		if (utf8Chars) {
+			size_t last = n;
+			while (last > bounds[nchunks - 1] && n - last < 4 &&
+					((typename Table::UCharType) chrs[last - 1] & 0xC0) == 0x80)
+				last --;
+			if (last > bounds[nchunks - 1] &&
+					utf8Length((unsigned char) chrs[last - 1]) > n - last + 1)
+				bounds[nchunks] = last - 1;
+		}
+		while (chunkMatchers.size() < nchunks - 1)
+			chunkMatchers.emplace_back(new Matcher(*this));
+		vector<uint32_t> entryStates(nchunks), entryAdded(nchunks);
+		// The helpers' lazy states are their own, only their sets compare
+		vector<vector<uint32_t>> entrySets(lazy ? nchunks : 0);
+		auto scanChunk = [&](size_t k) {
+			Matcher &m = *chunkMatchers[k - 1];
+			size_t start = bounds[k], from = start - min(start, warmup);
+			m.curstate = m.addedState = 0;
+			m.curPos = basePos + from;
+			m.charCode = 0;
+			m.extraBytes = m.floorExtra = baseExtra;
+			m.charBytesCount = 0;
+			m.sink = nullptr;
+			m.feed(chrs + from, start - from);
+			m.candHead = m.candTail = 0;
+			m.keepMatches = keepMatches;
+			m.clearResults();
+			m.chunkSpans.clear();
+			if (sink)
+				m.sink = &m.chunkSpans;
+			m.earliestStart = SIZE_MAX;
+			m.chunkStart = m.curPos;
+			// A character still pending would be stepped within the chunk
+			entryStates[k] = m.charCode == 0 ? m.curstate : (uint32_t) Table::NO_ROW;
+			entryAdded[k] = m.addedState;
+			if (lazy)
+				entrySets[k] = *m.lazy->sets[m.curstate];
+			m.feed(chrs + start, bounds[k + 1] - start);
+		};
+		vector<thread> threads;
+		for (size_t k = 1; k < nchunks; k ++)
+			threads.emplace_back(scanChunk, k);
+		feed(chrs, bounds[1]);
+		for (auto &th : threads)
+			th.join();
+
+		for (size_t k = 1; k < nchunks; k ++) {
+			size_t start = bounds[k], end = bounds[k + 1];
+			Matcher &m = *chunkMatchers[k - 1];
+			const bool sameEntry = lazy ? entryStates[k] != (uint32_t) Table::NO_ROW &&
+				entrySets[k] == *lazy->sets[curstate] : entryStates[k] == curstate;
+			// The helper can't hand over a truncated character either
+			if (!sameEntry || entryAdded[k] != addedState || charCode != 0 ||
+					m.charCode != 0) { // Speculation failed, redo it here
+				feed(chrs + start, end - start);
+				continue;
+			}
+			// In UTF-8 mode, the helper could only guess its position from
+			// the byte offset: shift its candidates (modulo 2^64) to ours.
+			// Its matches and spans are byte offsets, which it knew.
+			const size_t shift = curPos - m.chunkStart;
+			// Our remaining candidates all start before this chunk and are
+			// finalized during it, unless one of its candidates overlaps them
+			while (candTail != candHead &&
+					candidates[(candTail - 1) & candMask].startPos >= m.earliestStart + shift)
+				candTail --;
+			while (candHead != candTail)
+				accept(candidates[candHead ++ & candMask]);
+			if (sink)
+				for (auto &span : m.chunkSpans.spans)
+					sink->match(span.termid, span.startPos, span.endPos);
+			matches.splice(matches.end(), m.matches);
+			for (uint32_t termid : m.counts.touched)
+				counts.add(termid, m.counts.counts[termid]);
+			m.counts.clear();
+			for (; m.candHead != m.candTail; m.candHead ++) {
+				Candidate cand = m.candidates[m.candHead & candMask];
+				cand.startPos += shift;
+				candidates[candTail ++ & candMask] = cand;
+			}
+			curstate = lazy ? lazy->adopt(*m.lazy->sets[m.curstate]) : m.curstate;
+			addedState = m.addedState;
+			curPos = m.curPos + shift;
+			extraBytes = m.extraBytes - shift;
+			floorExtra = m.floorExtra - shift;
+			charBytesCount = m.charBytesCount;
+			for (size_t i = 0; i < charBytes.size(); i ++)
+				charBytes[i] = CharBytes{m.charBytes[i].pos + shift,
+					m.charBytes[i].extra - shift};
+		}
+		feed(chrs + bounds[nchunks], n - bounds[nchunks]);
+	}
+
 	template<class CharType>
 	void TermGrepT::Matcher::end() {
+		if (charCode != 0)
+			abandonChar();
+		inputEnd = curPos - 1;
 		feed((CharType)'\t');
-		matches.splice(matches.end(), candidates);
+		while (candHead != candTail)
+			accept(candidates[candHead ++ & candMask]);
 	}
 
+	/*!
+	 * While the matcher is on its root, with no multibyte character pending,
+	 * the characters that the prefilter skips would leave it there without
+	 * ending a term: they only take their position. Where candidates are
+	 * dense, calling the prefilter costs more than it skips, so after a
+	 * short skip the next PREFILTER_BACKOFF characters are stepped through.
+	 */
 	template<class CharType>
 	void TermGrepT::Matcher::feed(const CharType *chrs, size_t n) {
-		for (size_t i = 0; i < n; i ++) {
-			feed(chrs[i]);
+		const Prefilter *skipper = usePrefilter ? prefilter.get() : nullptr;
+		size_t resume = 0;
+		for (size_t i = 0; i < n; ) {
+			if (skipper && i >= resume && curstate == 0 && addedState == 0 && charCode == 0) {
+				const size_t skipped = skipper->skip(chrs + i, n - i);
+				curPos += skipped;
+				i += skipped;
+				if (i == n)
+					break;
+				if (skipped < PREFILTER_MIN_SKIP)
+					resume = i + PREFILTER_BACKOFF;
+			}
+			feed(chrs[i ++]);
+		}
+	}
+
+	/*!
+	 * A character pair is alive if, from the root, the first character ends
+	 * a term or the second one doesn't lead back to the root, in the table
+	 * or in the added one. As the root is part of every state's set, a step
+	 * to the root from any state is also one from the root: when the pair
+	 * is dead, the first character can be taken as leaving the matcher on
+	 * the root. In UTF-8 mode, bytes that are part of multibyte characters
+	 * are always alive.
+	 */
+	template<class CharType>
+	void TermGrepT::Matcher::makePrefilter() {
+		prefilter.reset();
+		// Lazy matchers are probed on a throwaway cache, without a limit
+		unique_ptr<LazyTable> probe;
+		if (lazy)
+			probe.reset(new LazyTable(table, SIZE_MAX, this->terms));
+		auto step = [&](uint32_t state, CharType chr) {
+			const uint32_t cls = table->classOf(chr);
+			return probe ? probe->step(state, cls) : table->step(state, cls);
+		};
+		auto termid = [&](uint32_t state) {
+			return probe ? probe->termids[state] : table->termids[state];
+		};
+		if (termid(0) != 0 || (added && added->termids[0] != 0))
+			return; // The empty term matches everywhere
+		vector<uint64_t> pairs(256 * 4, 0), starts(4, 0);
+		auto set = [](vector<uint64_t> &bits, unsigned bit) {
+			bits[bit >> 6] |= (uint64_t) 1 << (bit & 63);
+		};
+		for (unsigned c0 = 0; c0 < 256; c0 ++) {
+			const bool multibyte = table->utf8 && c0 >= 0x80;
+			const uint32_t s1 = multibyte ? 0 : step(0, c0),
+				a1 = multibyte || !added ? 0 : added->step(0, added->classOf(c0));
+			if (!multibyte && s1 == 0 && a1 == 0)
+				continue;
+			set(starts, c0);
+			const bool ends = multibyte || termid(s1) != 0 ||
+				(added && added->termids[a1] != 0);
+			for (unsigned c1 = 0; c1 < 256; c1 ++)
+				if (ends || (table->utf8 && c1 >= 0x80) || step(s1, c1) != 0 ||
+						(added && added->step(a1, added->classOf(c1)) != 0))
+					set(pairs, c0 << 8 | c1);
 		}
+		// Not worth it when most pairs of printable characters are alive
+		size_t alive = 0;
+		for (unsigned c0 = 0x20; c0 < 0x7F; c0 ++)
+			for (unsigned c1 = 0x20; c1 < 0x7F; c1 ++)
+				alive += (pairs[(c0 << 8 | c1) >> 6] >> (c1 & 63)) & 1;
+		if (alive * 2 > 95 * 95)
+			return;
+		auto pairAlive = [&](unsigned c0, unsigned c1) {
+			return (pairs[(c0 << 8 | c1) >> 6] >> (c1 & 63)) & 1;
+		};
+		// An alive pair that ends no term, followed by a character that leads
+		// back to the root without ending a term either, also leaves the
+		// matcher on the root once the second and third characters form a
+		// dead pair
+		shared_ptr<Prefilter> refined = make_shared<Prefilter>(pairs, starts);
+		const unsigned last = table->utf8 ? 0x80 : 256;
+		bool room = true;
+		for (unsigned c0 = 0; room && c0 < last; c0 ++)
+			for (unsigned c1 = 0; room && c1 < last; c1 ++) {
+				if (!pairAlive(c0, c1))
+					continue;
+				const uint32_t s1 = step(0, c0),
+					a1 = added ? added->step(0, added->classOf(c0)) : 0;
+				if (termid(s1) != 0 || (added && added->termids[a1] != 0))
+					continue;
+				const uint32_t s2 = step(s1, c1),
+					a2 = added ? added->step(a1, added->classOf(c1)) : 0;
+				if (termid(s2) != 0 || (added && added->termids[a2] != 0))
+					continue;
+				vector<uint64_t> thirds(4, 0);
+				for (unsigned c2 = 0; c2 < 256; c2 ++)
+					if (c2 >= last || pairAlive(c1, c2) || step(s2, c2) != 0 ||
+							(added && added->step(a2, added->classOf(c2)) != 0))
+						set(thirds, c2);
+				if (thirds != vector<uint64_t>(4, ~(uint64_t) 0))
+					room = refined->refine(c0, c1, thirds.data());
+			}
+		prefilter = refined;
+	}
+
+	template<class CharType>
+	const char *TermGrepT::Matcher::getPrefilterName() const {
+		return prefilter && usePrefilter ? prefilter->name() : nullptr;
 	}
 
 	template<class CharType>
@@ -309,18 +1465,16 @@ namespace termgrep {
 	template<class CharType>
 	map<size_t, size_t> &TermGrepT::Matcher::getTermidOccurences
 			(map<size_t, size_t> &occurences) {
-		for(Match &m : matches) {
-			occurences[m.termid] ++;
-		}
+		for (uint32_t termid : counts.touched)
+			occurences[termid] += counts.counts[termid];
 		return occurences;
 	}
 
 	template<class CharType>
 	map<strtype, size_t> &TermGrepT::Matcher::getTermOccurences
 			(map<strtype, size_t> &occurences) {
-		for(Match &m : matches) {
-			occurences[m.term] ++;
-		}
+		for (uint32_t termid : counts.touched)
+			occurences[this->getTerm(termid)] += counts.counts[termid];
 		return occurences;
 	}
 
@@ -329,100 +1483,862 @@ namespace termgrep {
 	 * the parent TermGrep's states are considered to have an implicit empty
 	 * transition to the Start node, making the FSM nondeterministic. Then we
 	 * use the method to make it deterministic again.
+	 *
+	 * Sets of TermGrep states are sorted id vectors, interned in a hash
+	 * table, and expanded from a worklist rather than recursively, so that
+	 * neither the stack depth nor the cost of building the key grows with
+	 * the number of terms.
 	*/
 	template<class CharType>
 	TermGrepT::Matcher::Matcher(TermGrep &grep) :
 			AbstractFSMT(grep._terms), grep(grep),
-			curstate(nullptr), longestTerm(grep.longestTerm) {
-		struct stateid {
+			curstate(0), compiledTerms(grep._terms.size()),
+			compiledRemovals(grep.removals),
+			longestTerm(grep.longestTerm) {
+		auto started = chrono::steady_clock::now();
+		grep.rebuildTrie();
+		const auto &trie = grep.states;
+		typedef vector<uint32_t> IdSet;
+		unordered_map<IdSet, uint32_t, IdVectorHash> interned;
+		interned.reserve(trie.size());
+		// Sets still to expand, pointing into 'interned' (whose keys don't move)
+		vector<pair<const IdSet *, uint32_t>> worklist;
+		size_t setBytes = 0;
+		// Terms are compared on the positions they span, not their bytes
+		vector<size_t> termLengths;
+		for (auto &term : grep._terms)
+			termLengths.push_back(termLength(term, grep.utf8));
+
+		// Returns the matcher state for a set, creating it if needed
+		auto intern = [&](IdSet &ids) -> uint32_t {
+			auto found = interned.find(ids);
+			if (found != interned.end())
+				return found->second;
+			const StateTN &first = trie[ids.front()];
+			uint32_t id = first.isfunc() ? this->addState(grep.funcs[first.func - 1]) :
+				this->addState(first.chr);
+			size_t termlen = 0;
+			for (uint32_t tid : ids) {
+				const StateTN &st = trie[tid];
+				if (st.termid != 0 && termLengths[st.termid] > termlen) {
+					this->states[id].termid = st.termid;
+					termlen = termLengths[st.termid];
+				}
+			}
+			setBytes += ids.size() * sizeof(uint32_t) + sizeof(IdSet) + 4 * sizeof(void *);
+			auto ins = interned.insert(make_pair(move(ids), id));
+			worklist.emplace_back(&ins.first->first, id);
+			return id;
+		};
+
+		// Edges are grouped by label: characters in ascending order, then
+		// the word boundary
+		struct Edge {
+			bool isfunc;
 			CharType chr;
-			CheckFuncT func;
-			stateid(const StatePtr st) :
-					chr(st->isfunc ? (CharType) 0 : st->chr),
-					func(st->isfunc ? st->func : CheckFuncT()) {}
-			bool operator==(const stateid &st) {
-				return chr == st.chr && func.operator==(st.func);
+			uint32_t to;
+			bool operator<(const Edge &e) const {
+				if (isfunc != e.isfunc)
+					return e.isfunc;
+				if (chr != e.chr)
+					return chr < e.chr;
+				return to < e.to;
 			}
+			bool sameLabel(const Edge &e) const
+				{ return isfunc == e.isfunc && chr == e.chr; }
 		};
-		auto addStateById = [this](struct stateid sid) -> size_t {
-			if (sid.chr != 0)
-				return this->addState(sid.chr);
-			else
-				return this->addState(sid.func);
+		vector<Edge> edges;
+		IdSet next;
+		vector<uint32_t> targets;
+		IdSet root(1, 0);
+		intern(root);
+		while (!worklist.empty()) {
+			const IdSet &current = *worklist.back().first;
+			const uint32_t newState = worklist.back().second;
+			worklist.pop_back();
+
+			edges.clear();
+			auto addEdges = [&](uint32_t from) {
+				for (uint32_t e = trie[from].firstEdge; e != AbstractFSMT::NO_EDGE;
+						e = grep.edges[e].next) {
+					const uint32_t to = grep.edges[e].to;
+					edges.push_back(Edge{trie[to].isfunc(), trie[to].chr, to});
+				}
+			};
+			for (uint32_t id : current)
+				addEdges(id);
+			if (current.front() != 0) // Implicit empty transition
+				addEdges(0);
+			sort(edges.begin(), edges.end());
+
+			targets.clear();
+			for (size_t i = 0; i < edges.size(); ) {
+				next.clear();
+				size_t j = i;
+				for (; j < edges.size() && edges[j].sameLabel(edges[i]); j ++)
+					if (next.empty() || next.back() != edges[j].to)
+						next.push_back(edges[j].to);
+				i = j;
+				targets.push_back(intern(next));
+			}
+			// In reverse, as the edge lists have always been built
+			for (auto to = targets.rbegin(); to != targets.rend(); ++ to)
+				this->addEdge(newState, *to);
+		}
+		buildStats.states = this->states.size();
+		buildStats.edges = this->edges.size();
+		buildStats.peakBytes = setBytes + interned.bucket_count() * sizeof(void *)
+			+ this->stateBytes();
+		interned.clear();
+
+		auto compiling = chrono::steady_clock::now();
+		buildStats.subsetSeconds = chrono::duration<double>(compiling - started).count();
+		compile();
+		auto compiled = chrono::steady_clock::now();
+		buildStats.compileSeconds = chrono::duration<double>(compiled - compiling).count();
+		buildStats.seconds = chrono::duration<double>(compiled - started).count();
+		makePrefilter();
+		initBuffers();
+		reset();
+	}
+
+	template<class CharType>
+	TermGrepT::Matcher::Matcher(const Matcher &other) :
+			AbstractFSMT(other.grep._terms), grep(other.grep), table(other.table),
+			curstate(0), overlay(other.overlay), added(other.added),
+			compiledTerms(other.compiledTerms),
+			compiledRemovals(other.compiledRemovals), prefilter(other.prefilter),
+			usePrefilter(other.usePrefilter), keepMatches(other.keepMatches),
+			longestTerm(other.longestTerm) {
+		if (other.lazy)
+			lazy.reset(new LazyTable(table, other.lazy->maxBytes, this->terms));
+		initBuffers();
+		reset();
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::reset() {
+		if (lazy)
+			lazy->restart(curPos);
+		curstate = addedState = 0;
+		curPos = 0;
+		inputEnd = SIZE_MAX;
+		clearResults();
+		candHead = candTail = 0;
+		charCode = 0;
+		extraBytes = floorExtra = charBytesCount = 0;
+		feed((CharType)'\t');
+	}
+
+	template<class CharType>
+	void TermGrepT::Matcher::initBuffers() {
+		size_t size = 1;
+		while (size < longestTerm + 2)
+			size <<= 1;
+		candidates.assign(size, Candidate{0, 0, 0, 0, 0});
+		charBytes.assign(table->utf8 ? size : 0, CharBytes{0, 0});
+		candMask = size - 1;
+		termLengths.clear();
+		for (auto &term : this->getTerms())
+			termLengths.push_back(termLength(term, table->utf8));
+		termBounded.assign(grep.termBounds.begin(), grep.termBounds.end());
+		counts = TermCounts(this->getTerms().size());
+		utf8Chars = table->utf8 ? &Utf8Chars::get() : nullptr;
+	}
+
+	template<class CharType>
+	unique_ptr<typename TermGrepT::Matcher> TermGrepT::makeChecker(MatcherEngine engine) {
+		if (engine != MatcherEngine::POWERSET)
+			return unique_ptr<Matcher>(new TermGrepT::Matcher(*this, engine));
+		return move(unique_ptr<Matcher>(new TermGrepT::Matcher(*this)));
+	}
+
+	template<class CharType>
+	unique_ptr<typename TermGrepT::Matcher> TermGrepT::makeLazyChecker(size_t cacheBytes) {
+		return unique_ptr<Matcher>(new TermGrepT::Matcher(*this, cacheBytes));
+	}
+
+	/*!
+	 * \brief Lazy matcher: its table is the trie's, as is, from which
+	 * LazyTable makes the states of the automaton as they are visited.
+	 */
+	template<class CharType>
+	TermGrepT::Matcher::Matcher(TermGrep &grep, size_t lazyBytes) :
+			AbstractFSMT(grep._terms), grep(grep),
+			curstate(0), compiledTerms(grep._terms.size()),
+			compiledRemovals(grep.removals),
+			longestTerm(grep.longestTerm) {
+		auto started = chrono::steady_clock::now();
+		shared_ptr<Table> tableptr(new Table());
+		Table &nfa = *tableptr;
+		vector<uint32_t> rowStart, labels, targets, boundaryTarget, termids;
+		grep.rebuildTrie();
+		buildRows(nfa, grep.states, grep.edges, grep.utf8, rowStart, labels, targets,
+			boundaryTarget, termids);
+		buildStats.states = buildStats.minimizedStates = termids.size();
+		buildStats.edges = buildStats.minimizedEdges = labels.size()
+			+ count_if(boundaryTarget.begin(), boundaryTarget.end(),
+				[](uint32_t to) { return to != 0; });
+		nfa.rowStart = move(rowStart);
+		nfa.labels = move(labels);
+		nfa.targets = move(targets);
+		nfa.boundaryTarget = move(boundaryTarget);
+		nfa.termids = move(termids);
+		table = tableptr;
+		lazy.reset(new LazyTable(table, lazyBytes, this->terms));
+		buildStats.peakBytes = table->bytes();
+		buildStats.compileSeconds = buildStats.seconds =
+			chrono::duration<double>(chrono::steady_clock::now() - started).count();
+		makePrefilter();
+		initBuffers();
+		reset();
+	}
+
+	/*!
+	 * \brief Aho-Corasick matcher, built on the trie's rows. The powerset
+	 * construction only ever makes sets of trie states that are a state and
+	 * the states along its failure links (the longest suffixes of its path
+	 * in the trie, the word boundary being a label of its own), so the
+	 * state can stand for its set. A step then takes the character edge of
+	 * the first state along the links that has one or, like the powerset's
+	 * sets, the word boundary edge of the first one that has one only when
+	 * none has a character edge: boundaryTarget is set to it. The termid of
+	 * a state is the longest term ending along its links.
+	 *
+	 * For AHO_CORASICK_DFA, the rows are then completed with the edges found
+	 * along the links, which makes a table like compile()'s, minimized and
+	 * made dense the same way. Its states are numbered breadth-first.
+	 */
+	template<class CharType>
+	TermGrepT::Matcher::Matcher(TermGrep &grep, MatcherEngine engine) :
+			AbstractFSMT(grep._terms), grep(grep),
+			curstate(0), compiledTerms(grep._terms.size()),
+			compiledRemovals(grep.removals),
+			longestTerm(grep.longestTerm) {
+		auto started = chrono::steady_clock::now();
+		shared_ptr<Table> tableptr(new Table());
+		Table &table = *tableptr;
+		vector<uint32_t> rowStart, labels, targets, boundaryTarget, termids;
+		grep.rebuildTrie();
+		buildRows(table, grep.states, grep.edges, grep.utf8, rowStart, labels, targets,
+			boundaryTarget, termids);
+		const size_t nstates = termids.size();
+		buildStats.states = nstates;
+		buildStats.edges = labels.size()
+			+ count_if(boundaryTarget.begin(), boundaryTarget.end(),
+				[](uint32_t to) { return to != 0; });
+		auto edge = [&](uint32_t st, uint32_t cls) -> uint32_t {
+			auto first = labels.begin() + rowStart[st],
+				last = labels.begin() + rowStart[st + 1];
+			auto it = lower_bound(first, last, cls);
+			return it != last && *it == cls ? targets[it - labels.begin()] : 0;
 		};
+		auto termlen = [&](uint32_t tid) { return termLength(this->terms[tid], grep.utf8); };
 
-		struct stateidcmp {
-			bool operator() (const struct stateid &si1, const struct stateid &si2) const {
-				if (si1.chr == si2.chr)
-					return si1.func.label < si2.func.label;
-				else if (si1.func.label == si2.func.label)
-					return si1.chr < si2.chr;
-				else return si1.func.label == CheckFuncT::DEFAULT_LABEL;
+		// Breadth-first, so that the links of a state point to states done
+		// already. Ties between terms go to the lowest state, like in the
+		// powerset's sets.
+		vector<uint32_t> order(1, 0), fail(nstates, 0), termNode(nstates);
+		order.reserve(nstates);
+		for (size_t i = 0; i < order.size(); i ++) {
+			const uint32_t st = order[i];
+			for (uint32_t e = rowStart[st]; e < rowStart[st + 1]; e ++) {
+				uint32_t link = 0;
+				if (st != 0)
+					for (uint32_t k = fail[st]; (link = edge(k, labels[e])) == 0 && k != 0; )
+						k = fail[k];
+				fail[targets[e]] = link;
+				order.push_back(targets[e]);
 			}
-			bool operator() (const StatePtr &si1, const StatePtr &si2) const {
-				return si1->id < si2->id;
+			if (uint32_t to = boundaryTarget[st]) {
+				fail[to] = st != 0 ? boundaryTarget[fail[st]] : 0;
+				order.push_back(to);
 			}
-		};
+			termNode[st] = st;
+			if (st == 0)
+				continue;
+			const uint32_t link = fail[st];
+			if (boundaryTarget[st] == 0)
+				boundaryTarget[st] = boundaryTarget[link];
+			const uint32_t tid = termids[st], other = termids[link];
+			if (other != 0 && (tid == 0 || termlen(other) > termlen(tid) ||
+					(termlen(other) == termlen(tid) && termNode[link] < st))) {
+				termids[st] = other;
+				termNode[st] = termNode[link];
+			}
+		}
+		vector<uint32_t>().swap(termNode);
+		auto linked = chrono::steady_clock::now();
+		buildStats.subsetSeconds = chrono::duration<double>(linked - started).count();
+		buildStats.peakBytes = table.bytes() + (rowStart.size() + labels.size()
+			+ targets.size() + 4 * nstates) * sizeof(uint32_t);
 
-		typedef set<StatePtr, stateidcmp> StatePtrSet;
-		StatePtrSet root;
-		map<const set<size_t>, const StatePtr> newStates;
-		root.insert(grep.getRoot());
-		function<StatePtr(StatePtrSet)> transformRecurse = [this, &addStateById, &transformRecurse, &newStates](StatePtrSet current) -> StatePtr {
-			set<size_t> curIds;
-			size_t termid = 0, termlen = 0;
-			for (StatePtr st : current) {
-				curIds.insert(st->id);
-				if (st->termid != 0 && this->grep.getTerm(st->termid).length() > termlen) {
-					termid = st->termid;
-					termlen = this->grep.getTerm(st->termid).length();
+		if (engine == MatcherEngine::AHO_CORASICK_DFA) {
+			vector<uint32_t> newId(nstates);
+			for (size_t i = 0; i < nstates; i ++)
+				newId[order[i]] = i;
+			vector<uint32_t> fullStart(1, 0), fullLabels, fullTargets,
+				fullBoundary(nstates), fullTermids(nstates);
+			for (size_t i = 0; i < nstates; i ++) {
+				const uint32_t st = order[i];
+				// Merges the state's own row with the completed one of its link
+				uint32_t e = rowStart[st], f = 0, fend = 0;
+				if (st != 0) {
+					f = fullStart[newId[fail[st]]];
+					fend = fullStart[newId[fail[st]] + 1];
+				}
+				while (e < rowStart[st + 1] || f < fend) {
+					if (f == fend || (e < rowStart[st + 1] && labels[e] <= fullLabels[f])) {
+						if (f < fend && labels[e] == fullLabels[f])
+							f ++;
+						fullLabels.push_back(labels[e]);
+						fullTargets.push_back(newId[targets[e ++]]);
+					} else {
+						fullLabels.push_back(fullLabels[f]);
+						fullTargets.push_back(fullTargets[f ++]);
+					}
 				}
+				fullStart.push_back(fullLabels.size());
+				fullBoundary[i] = newId[boundaryTarget[st]];
+				fullTermids[i] = termids[st];
 			}
+			buildStats.peakBytes += (fullStart.size() + 2 * fullLabels.size()
+				+ 3 * nstates) * sizeof(uint32_t);
+			rowStart.swap(fullStart);
+			labels.swap(fullLabels);
+			targets.swap(fullTargets);
+			boundaryTarget.swap(fullBoundary);
+			termids.swap(fullTermids);
+			vector<uint32_t>().swap(fail);
+			minimizeRows(rowStart, labels, targets, boundaryTarget, termids,
+				table.classBoundary, table.utf8);
+		}
+		vector<uint32_t>().swap(order);
+		// The boundary targets found along the links aren't edges of the trie
+		buildStats.minimizedStates = termids.size();
+		buildStats.minimizedEdges = fail.empty() ? labels.size()
+			+ count_if(boundaryTarget.begin(), boundaryTarget.end(),
+				[](uint32_t to) { return to != 0; }) : buildStats.edges;
+		table.rowStart = move(rowStart);
+		table.labels = move(labels);
+		table.targets = move(targets);
+		table.boundaryTarget = move(boundaryTarget);
+		table.termids = move(termids);
+		table.fail = move(fail);
+		addDenseRows(table, engine == MatcherEngine::AHO_CORASICK_DFA);
+		this->table = tableptr;
+		auto compiled = chrono::steady_clock::now();
+		buildStats.compileSeconds = chrono::duration<double>(compiled - linked).count();
+		buildStats.seconds = chrono::duration<double>(compiled - started).count();
+		makePrefilter();
+		initBuffers();
+		reset();
+	}
+
+	template<class CharType>
+	size_t TermGrepT::Matcher::overlaid(size_t termid) const {
+		if (termid != 0 && !overlay->remap.empty())
+			termid = overlay->remap[termid];
+		if (added) {
+			size_t other = overlay->addedTermids[added->termids[addedState]];
+			// On a tie the added term is the later duplicate, which wins
+			if (other != 0 && (termid == 0 || termLengths[other] >= termLengths[termid]))
+				termid = other;
+		}
+		return termid;
+	}
 
-			typename map<const set<size_t>, const StatePtrTN>::iterator id;
-			if ((id = newStates.find(curIds)) != newStates.end()) // State exists. Abort
-				return get<1>(*id);
-			auto newState = this->states[addStateById(stateid(*current.begin()))];
-
-			newState->termid = termid;
-			newStates.insert(make_pair(curIds, newState));
-			map<const struct stateid, StatePtrSet, stateidcmp> nextStates;
-			current.insert(this->grep.getRoot());
-			for (auto c : current)
-				for (auto *nxt = c->next.get(); nxt; nxt = nxt->next.get()) {
-					auto sid = stateid(nxt->state);
-					if (nextStates.find(sid) == nextStates.end())
-						nextStates.insert(make_pair(sid, StatePtrSet()));
-					get<1>(*nextStates.find(sid)).insert(nxt->state);
+	/*!
+	 * \brief Longest term of the table that is a proper suffix of 'termid':
+	 * the one ending on the state the term leads to without its first
+	 * character (the leading word boundary, if it has one).
+	 */
+	template<class CharType>
+	size_t TermGrepT::Matcher::suffixTermid(size_t termid) const {
+		strtype term = this->terms[termid];
+		size_t i = 1;
+		if (grep.termBounds[termid])
+			term = wordBoundary<CharType>()+ term +wordBoundary<CharType>();
+		else if (table->utf8) {
+			uint32_t chr;
+			i = max<size_t>(1, utf8Decode(term.c_str(), chr));
+		}
+		uint32_t st = 0, decoded;
+		size_t len;
+		while (i < term.length()) {
+			if (table->utf8 && (typename Table::UCharType) term[i] >= 0x80 &&
+					(len = utf8Decode(term.c_str() + i, decoded)) > 1) {
+				// Like feedMultibyte() and endChar() would
+				const Utf8Chars &chars = Utf8Chars::get();
+				uint32_t path = st, code = 0;
+				for (size_t j = i; j < i + len; j ++) {
+					const auto byte = (typename Table::UCharType) term[j];
+					code = j == i ? chars.start[byte] : chars.next[code * 64 + (byte & 0x3F)];
+					path = table->step(path, table->classOf(term[j]));
 				}
-			unique_ptr<struct NextStateT> nextPtr;
-			for (auto next : nextStates) {
-				auto idSet = get<1>(next);
-				StatePtr st = transformRecurse(idSet);
-				nextPtr.reset(new NextStateTN{st});
-				nextPtr->next.swap(newState->next);
-				newState->next.swap(nextPtr);
+				st = utf8Step(*table, st, path, code - Utf8Chars::DONE);
+				i += len;
+			} else
+				st = table->step(st, table->classOf(term[i ++]));
+		}
+		return table->termids[st];
+	}
+
+	template<class CharType>
+	void TermGrepT::updateChecker(Matcher &matcher) {
+		if (matcher.lazy) {
+			// Its states come from the trie, which is up to date already
+			Matcher updated(*this, matcher.lazy->maxBytes);
+			matcher.table = updated.table;
+			matcher.lazy.swap(updated.lazy);
+			matcher.prefilter = updated.prefilter;
+			matcher.compiledTerms = _terms.size();
+			matcher.compiledRemovals = removals;
+			matcher.longestTerm = longestTerm;
+			matcher.chunkMatchers.clear();
+			matcher.initBuffers();
+			matcher.reset();
+			return;
+		}
+		const size_t compiled = matcher.compiledTerms;
+		// The edge of a word boundary character hides the word boundary
+		// edges at the same place, which only works within one automaton:
+		// all terms are compiled again when the added ones could take a
+		// word boundary edge that a term of the table hides, or the other
+		// way around, or when the states of a removed term would still
+		// hide some.
+		const bool tableChars = boundaryCharTerm != 0 && boundaryCharTerm < compiled;
+		bool addedBounds = false, addedChars = false;
+		for (size_t tid = compiled; tid < _terms.size(); tid ++) {
+			if (removedTerms[tid])
+				continue;
+			addedBounds = addedBounds || termBounds[tid];
+			addedChars = addedChars || hasBoundaryChars(_terms[tid], utf8);
+		}
+		if (addedChars || (tableChars &&
+				(addedBounds || removals > matcher.compiledRemovals))) {
+			matcher.table = makeChecker(matcher.table->fail.size() != 0 ?
+				MatcherEngine::AHO_CORASICK : MatcherEngine::POWERSET)->table;
+			matcher.compiledTerms = _terms.size();
+			matcher.compiledRemovals = removals;
+			matcher.overlay.reset();
+			matcher.added = nullptr;
+			matcher.longestTerm = longestTerm;
+			matcher.chunkMatchers.clear();
+			matcher.makePrefilter();
+			matcher.initBuffers();
+			matcher.reset();
+			return;
+		}
+		auto overlay = make_shared<typename Matcher::Overlay>();
+		TermGrep addedGrep(addWordBoundaries, utf8);
+		overlay->addedTermids.push_back(0);
+		for (size_t tid = compiled; tid < _terms.size(); tid ++) {
+			if (removedTerms[tid])
+				continue;
+			addedGrep.addTerm(_terms[tid], termBounds[tid]);
+			overlay->addedTermids.push_back(tid);
+		}
+		if (overlay->addedTermids.size() > 1)
+			overlay->added = Matcher(addedGrep).table;
+
+		// The table only ends the last duplicate of a term: when it was
+		// removed, the previous one left counts instead, like in the trie
+		// (see removeTerm()). Without word boundary characters in the table
+		// (else it was compiled again), duplicates are the terms with the
+		// same folded form, which unlike trie states loaded terms have too.
+		auto key = [&](size_t tid) {
+			strtype folded;
+			folded.push_back(termBounds[tid] ? wordBoundary<CharType>() : 0);
+			uint32_t decoded;
+			for (size_t i = 0, len; i < _terms[tid].length(); ) {
+				const CharType *chars = _terms[tid].c_str() + i;
+				if (utf8 && (typename Matcher::Table::UCharType) chars[0] >= 0x80 &&
+						(len = utf8Decode(chars, decoded)) > 1) {
+					folded += utf8Encode<CharType>(CharClass<wchar_t>::fold(decoded));
+					i += len;
+				} else
+					folded.push_back(CharClass<CharType>::fold(_terms[tid][i ++]));
 			}
-			return newState;
+			return folded;
 		};
-		transformRecurse(root);
+		map<strtype, size_t> lastDuplicate;
+		for (size_t tid = 1; tid < compiled; tid ++)
+			if (removedTerms[tid])
+				lastDuplicate[key(tid)] = 0;
+		if (!lastDuplicate.empty()) {
+			for (size_t tid = 1; tid < compiled; tid ++) {
+				if (removedTerms[tid])
+					continue;
+				auto dup = lastDuplicate.find(key(tid));
+				if (dup != lastDuplicate.end())
+					dup->second = tid;
+			}
+			overlay->remap.resize(compiled);
+			iota(overlay->remap.begin(), overlay->remap.end(), 0);
+		}
+		for (size_t tid = 1; tid < compiled; tid ++) {
+			if (!removedTerms[tid])
+				continue;
+			size_t suffix = tid;
+			while (suffix != 0 && removedTerms[suffix]) {
+				size_t dup = lastDuplicate[key(suffix)];
+				suffix = dup != 0 ? dup : matcher.suffixTermid(suffix);
+			}
+			overlay->remap[tid] = suffix;
+		}
+
+		if (overlay->added || !overlay->remap.empty()) {
+			matcher.overlay = overlay;
+			matcher.added = overlay->added.get();
+		} else {
+			matcher.overlay.reset();
+			matcher.added = nullptr;
+		}
+		matcher.longestTerm = max(matcher.longestTerm, longestTerm);
+		matcher.chunkMatchers.clear();
+		matcher.makePrefilter();
+		matcher.initBuffers();
+		matcher.reset();
+	}
+
+	template<class CharType>
+	TermGrepT::Matcher::Matcher(TermGrep &grep, shared_ptr<const Table> table) :
+			AbstractFSMT(grep._terms), grep(grep), table(table),
+			curstate(0), compiledTerms(grep._terms.size()),
+			compiledRemovals(grep.removals),
+			longestTerm(grep.longestTerm) {
+		makePrefilter();
+		initBuffers();
 		reset();
 	}
 
+	/*!
+	 * \brief Fixed-size header of a saved automaton. It is followed by the
+	 * table arrays and the term list, in the order of AutomatonLayout, each
+	 * starting on an 8 byte boundary so that they can be used in place once
+	 * mapped. Files are only valid on machines with the same byte order.
+	 * 'checksum' covers everything after the header, see PayloadChecksum.
+	 */
+	struct AutomatonHeader {
+		static const uint32_t VERSION = 6;
+		static const uint32_t ORDER_MARK = 0x01020304;
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint32_t charSize;
+		uint32_t nclasses;
+		uint32_t utf8;
+		uint32_t reserved;
+		uint64_t key;
+		uint64_t nwide;
+		uint64_t nstates;
+		uint64_t nedges;
+		uint64_t ndense;
+		uint64_t nfail;
+		uint64_t nterms;
+		uint64_t ntermChars;
+		uint64_t longestTerm;
+		uint64_t checksum;
+	};
+	static const char AUTOMATON_MAGIC[8] = {'T', 'G', 'R', 'E', 'P', 'D', 'F', 'A'};
+
+	//! Offsets of the sections of a saved automaton, derived from its header
+	struct AutomatonLayout {
+		size_t lowClass, wideClass, classBoundary, rowStart, labels, targets,
+			boundaryTarget, denseRow, dense, termids, fail, termOffsets,
+			termChars, total;
+		AutomatonLayout(const AutomatonHeader &hdr, size_t wideClassSize) {
+			total = sizeof(AutomatonHeader);
+			lowClass = section(256 * sizeof(uint32_t));
+			wideClass = section(hdr.nwide * wideClassSize);
+			classBoundary = section(hdr.nclasses * sizeof(uint8_t));
+			rowStart = section((hdr.nstates + 1) * sizeof(uint32_t));
+			labels = section(hdr.nedges * sizeof(uint32_t));
+			targets = section(hdr.nedges * sizeof(uint32_t));
+			boundaryTarget = section(hdr.nstates * sizeof(uint32_t));
+			denseRow = section(hdr.nstates * sizeof(uint32_t));
+			dense = section(hdr.ndense * sizeof(uint32_t));
+			termids = section(hdr.nstates * sizeof(uint32_t));
+			fail = section(hdr.nfail * sizeof(uint32_t));
+			termOffsets = section((hdr.nterms + 1) * sizeof(uint64_t));
+			termChars = section(hdr.ntermChars * hdr.charSize);
+		}
+	private:
+		size_t section(size_t bytes) {
+			size_t start = (total + 7) & ~(size_t) 7;
+			total = start + bytes;
+			return start;
+		}
+	};
+
+	/*!
+	 * \brief Checksum of the bytes after an automaton's header, added in
+	 * pieces as they are written, or at once when loaded. It mixes 8 bytes
+	 * at a time, so that checking a mapped file costs little next to
+	 * reading it: it is meant to catch truncated or torn files, not to
+	 * authenticate them.
+	 */
+	class PayloadChecksum {
+	public:
+		void add(const void *data, size_t bytes) {
+			const char *in = static_cast<const char *>(data);
+			total += bytes;
+			for (; fill != 0 && bytes > 0; bytes --)
+				addByte(*in ++);
+			for (; bytes >= 8; in += 8, bytes -= 8) {
+				uint64_t word;
+				memcpy(&word, in, 8);
+				mix(word);
+			}
+			for (; bytes > 0; bytes --)
+				addByte(*in ++);
+		}
+		uint64_t value() const {
+			PayloadChecksum sum = *this;
+			if (sum.fill != 0) {
+				uint64_t word = 0;
+				memcpy(&word, sum.pending, sum.fill);
+				sum.mix(word);
+			}
+			sum.mix(total);
+			return sum.hash ^ (sum.hash >> 32);
+		}
+	private:
+		uint64_t hash = 14695981039346656037ULL;
+		size_t total = 0;
+		char pending[8];
+		size_t fill = 0;
+
+		void mix(uint64_t word) {
+			hash = ((hash << 5 | hash >> 59) ^ word) * 0x9E3779B97F4A7C15ULL;
+		}
+		void addByte(char byte) {
+			pending[fill ++] = byte;
+			if (fill == 8) {
+				uint64_t word;
+				memcpy(&word, pending, 8);
+				mix(word);
+				fill = 0;
+			}
+		}
+	};
+
 	template<class CharType>
-	void TermGrepT::Matcher::reset() {
-		curstate = this->getRoot();
-		matches.clear();
-		candidates.clear();
-		feed((CharType)'\t');
-		nextCheck = 0;
+	uint64_t automatonKey(const vector<strtype> &terms, bool addWordBoundaries, bool utf8,
+			MatcherEngine engine) {
+		// FNV-1a
+		uint64_t hash = 14695981039346656037ULL;
+		auto mix = [&hash](uint64_t value) {
+			for (int i = 0; i < 8; i ++) {
+				hash ^= (value >> (8 * i)) & 0xff;
+				hash *= 1099511628211ULL;
+			}
+		};
+		mix(AutomatonHeader::VERSION);
+		mix(sizeof(CharType));
+		mix(addWordBoundaries);
+		mix(utf8);
+		mix((uint64_t) engine);
+		mix(terms.size());
+		for (auto &term : terms) {
+			mix(term.length());
+			for (CharType chr : term)
+				mix((typename make_unsigned<CharType>::type) chr);
+		}
+		return hash;
 	}
 
 	template<class CharType>
-	unique_ptr<typename TermGrepT::Matcher> TermGrepT::makeChecker() {
-		return move(unique_ptr<Matcher>(new TermGrepT::Matcher(*this)));
+	void TermGrepT::Matcher::save(const string &path, uint64_t key) const {
+		if (overlay || compiledTerms != this->terms.size())
+			throw runtime_error("Terms were added or removed since the automaton "
+				"was compiled, rebuild it before saving it");
+		if (lazy)
+			throw runtime_error("A lazy automaton can't be saved");
+		const Table &tbl = *table;
+		auto &terms = this->terms;
+		AutomatonHeader hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, AUTOMATON_MAGIC, sizeof(hdr.magic));
+		hdr.version = AutomatonHeader::VERSION;
+		hdr.byteOrder = AutomatonHeader::ORDER_MARK;
+		hdr.charSize = sizeof(CharType);
+		hdr.nclasses = tbl.nclasses;
+		hdr.utf8 = tbl.utf8;
+		hdr.key = key;
+		hdr.nwide = tbl.wideClass.size();
+		hdr.nstates = tbl.termids.size();
+		hdr.nedges = tbl.labels.size();
+		hdr.ndense = tbl.dense.size();
+		hdr.nfail = tbl.fail.size();
+		hdr.nterms = terms.size();
+		vector<uint64_t> termOffsets(1, 0);
+		for (auto &term : terms)
+			termOffsets.push_back(termOffsets.back() + term.length());
+		hdr.ntermChars = termOffsets.back();
+		hdr.longestTerm = longestTerm;
+		AutomatonLayout layout(hdr, sizeof(typename Table::WideClass));
+
+		// Written aside and renamed, as the table may be mapped from 'path'
+		const string tmpPath = path + ".tmp";
+		ofstream file(tmpPath, ios::binary | ios::trunc);
+		if (!file)
+			throw runtime_error("Can't create automaton file " + tmpPath);
+		size_t written = 0;
+		PayloadChecksum checksum;
+		auto write = [&](size_t offset, const void *data, size_t bytes) {
+			static const char padding[8] = {0};
+			file.write(padding, offset - written);
+			file.write(static_cast<const char *>(data), bytes);
+			if (offset != 0) {
+				checksum.add(padding, offset - written);
+				checksum.add(data, bytes);
+			}
+			written = offset + bytes;
+		};
+		write(0, &hdr, sizeof(hdr));
+		write(layout.lowClass, tbl.lowClass.data(), tbl.lowClass.size() * sizeof(uint32_t));
+		// Write the classes field by field: the struct may have padding
+		vector<char> wide(tbl.wideClass.size() * sizeof(typename Table::WideClass), 0);
+		for (size_t i = 0; i < tbl.wideClass.size(); i ++) {
+			auto *wc = &wide[i * sizeof(typename Table::WideClass)];
+			memcpy(wc + offsetof(typename Table::WideClass, chr),
+				&tbl.wideClass[i].chr, sizeof(CharType));
+			memcpy(wc + offsetof(typename Table::WideClass, cls),
+				&tbl.wideClass[i].cls, sizeof(uint32_t));
+		}
+		write(layout.wideClass, wide.data(), wide.size());
+		write(layout.classBoundary, tbl.classBoundary.data(), tbl.classBoundary.size());
+		write(layout.rowStart, tbl.rowStart.data(), tbl.rowStart.size() * sizeof(uint32_t));
+		write(layout.labels, tbl.labels.data(), tbl.labels.size() * sizeof(uint32_t));
+		write(layout.targets, tbl.targets.data(), tbl.targets.size() * sizeof(uint32_t));
+		write(layout.boundaryTarget, tbl.boundaryTarget.data(),
+			tbl.boundaryTarget.size() * sizeof(uint32_t));
+		write(layout.denseRow, tbl.denseRow.data(), tbl.denseRow.size() * sizeof(uint32_t));
+		write(layout.dense, tbl.dense.data(), tbl.dense.size() * sizeof(uint32_t));
+		write(layout.termids, tbl.termids.data(), tbl.termids.size() * sizeof(uint32_t));
+		write(layout.fail, tbl.fail.data(), tbl.fail.size() * sizeof(uint32_t));
+		write(layout.termOffsets, termOffsets.data(), termOffsets.size() * sizeof(uint64_t));
+		for (auto &term : terms) {
+			file.write(reinterpret_cast<const char *>(term.data()),
+				term.length() * sizeof(CharType));
+			checksum.add(term.data(), term.length() * sizeof(CharType));
+		}
+		written += hdr.ntermChars * sizeof(CharType);
+		hdr.checksum = checksum.value();
+		file.seekp(0);
+		file.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+		file.close();
+		if (!file || written != layout.total) {
+			::unlink(tmpPath.c_str());
+			throw runtime_error("Can't write automaton file " + tmpPath);
+		}
+		if (::rename(tmpPath.c_str(), path.c_str()) != 0) {
+			::unlink(tmpPath.c_str());
+			throw runtime_error("Can't replace automaton file " + path);
+		}
 	}
 
+	template<class CharType>
+	unique_ptr<typename TermGrepT::Matcher> TermGrepT::loadChecker(const string &path,
+			uint64_t key) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return nullptr;
+		struct stat st;
+		void *map = MAP_FAILED;
+		if (::fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(AutomatonHeader))
+			map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED)
+			return nullptr;
+		const size_t size = st.st_size;
+		shared_ptr<const void> mapping(map, [size](const void *ptr) {
+			::munmap(const_cast<void *>(ptr), size);
+		});
+
+		const char *base = static_cast<const char *>(map);
+		const AutomatonHeader &hdr = *reinterpret_cast<const AutomatonHeader *>(base);
+		if (memcmp(hdr.magic, AUTOMATON_MAGIC, sizeof(hdr.magic)) != 0 ||
+				hdr.version != AutomatonHeader::VERSION ||
+				hdr.byteOrder != AutomatonHeader::ORDER_MARK ||
+				hdr.charSize != sizeof(CharType) || hdr.key != key)
+			return nullptr;
+		// Counts are bounded by the file first, so that the layout can't overflow
+		for (uint64_t count : {(uint64_t) hdr.nclasses, hdr.nwide, hdr.nstates,
+				hdr.nedges, hdr.ndense, hdr.nfail, hdr.nterms, hdr.ntermChars})
+			if (count > size)
+				return nullptr;
+		typedef typename Matcher::Table Table;
+		AutomatonLayout layout(hdr, sizeof(typename Table::WideClass));
+		if (layout.total != size || hdr.nterms == 0 || hdr.utf8 > 1 ||
+				(hdr.utf8 != 0 && sizeof(CharType) != 1))
+			return nullptr;
+		PayloadChecksum checksum;
+		checksum.add(base + sizeof(AutomatonHeader), size - sizeof(AutomatonHeader));
+		if (checksum.value() != hdr.checksum)
+			return nullptr;
+		auto at = [base](size_t offset) -> const void * { return base + offset; };
+
+		shared_ptr<Table> tableptr(new Table());
+		Table &table = *tableptr;
+		table.nclasses = hdr.nclasses;
+		table.utf8 = hdr.utf8 != 0;
+		table.lowClass.view((const uint32_t *) at(layout.lowClass), Table::LOW_CHARS);
+		table.wideClass.view((const typename Table::WideClass *) at(layout.wideClass), hdr.nwide);
+		table.classBoundary.view((const uint8_t *) at(layout.classBoundary), hdr.nclasses);
+		table.rowStart.view((const uint32_t *) at(layout.rowStart), hdr.nstates + 1);
+		table.labels.view((const uint32_t *) at(layout.labels), hdr.nedges);
+		table.targets.view((const uint32_t *) at(layout.targets), hdr.nedges);
+		table.boundaryTarget.view((const uint32_t *) at(layout.boundaryTarget), hdr.nstates);
+		table.denseRow.view((const uint32_t *) at(layout.denseRow), hdr.nstates);
+		table.dense.view((const uint32_t *) at(layout.dense), hdr.ndense);
+		table.termids.view((const uint32_t *) at(layout.termids), hdr.nstates);
+		table.fail.view((const uint32_t *) at(layout.fail), hdr.nfail);
+		table.mapping = mapping;
+		if (!table.valid(hdr.nterms))
+			return nullptr;
+
+		auto *termOffsets = (const uint64_t *) at(layout.termOffsets);
+		auto *termChars = (const CharType *) at(layout.termChars);
+		if (termOffsets[0] != 0 || termOffsets[hdr.nterms] != hdr.ntermChars)
+			return nullptr;
+		for (size_t i = 0; i < hdr.nterms; i ++)
+			if (termOffsets[i] > termOffsets[i + 1])
+				return nullptr;
+		vector<strtype> terms;
+		size_t longest = 0;
+		for (size_t i = 0; i < hdr.nterms; i ++) {
+			terms.emplace_back(termChars + termOffsets[i], termChars + termOffsets[i + 1]);
+			if (i != 0)
+				longest = max(longest, termLength(terms.back(), table.utf8));
+		}
+		// The saved length may exceed the terms', if some were removed before
+		// the table was compiled, but a shorter one would lose candidates
+		if (hdr.longestTerm < longest)
+			return nullptr;
+
+		// Nothing is changed until the file is known to be valid
+		_terms.swap(terms);
+		longestTerm = longest;
+		utf8 = table.utf8;
+		termBounds.assign(_terms.size(), addWordBoundaries);
+		termBounds[0] = false;
+		// The loaded terms have no trie states until rebuildTrie()
+		termNodes.assign(_terms.size(), 0);
+		staleTrie = true;
+		removedTerms.assign(_terms.size(), false);
+		boundaryCharTerm = 0;
+		for (size_t tid = 1; tid < _terms.size() && boundaryCharTerm == 0; tid ++)
+			if (hasBoundaryChars(_terms[tid], utf8))
+				boundaryCharTerm = tid;
+		return unique_ptr<Matcher>(new Matcher(*this, tableptr));
+	}
+
+	template uint64_t automatonKey<char>(const vector<string> &, bool, bool, MatcherEngine);
+	template uint64_t automatonKey<wchar_t>(const vector<wstring> &, bool, bool, MatcherEngine);
+
 	template class AbstractFSM<char>;
 	template class TermGrep<char>;
 
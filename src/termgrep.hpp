@@ -2,6 +2,9 @@
 #include <list>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <type_traits>
 
 #ifndef TERMGREP_NO_GVPP
 #include "gvpp.hpp"
@@ -27,7 +30,7 @@ namespace termgrep {
 		static const strtype DEFAULT_LABEL;
 		strtype label = DEFAULT_LABEL;
 		function<bool(int)> func = [](int i) -> bool {return true;};
-		bool operator()(int chr) { return func(chr); }
+		bool operator()(int chr) const { return func(chr); }
 		bool operator==(CheckFunc<CharType> cf)
 			{ return this->label == cf.label; }
 		CheckFunc() {}
@@ -35,56 +38,239 @@ namespace termgrep {
 			label(label), func(func) {}
 	};
 
+	/*!
+	 * \brief Case folding and word-boundary classification of characters.
+	 * They are fixed tables rather than locale lookups, so that matches don't
+	 * depend on the global locale: 'char' follows the C locale (only ASCII is
+	 * folded or punctuation), 'wchar_t' the Unicode tables in
+	 * unicodetables.hpp.
+	 */
+	template<class CharType>
+	struct CharClass {
+		static CharType fold(CharType chr);
+		static bool isBoundary(CharType chr);
+		//! The characters that fold to another one, in ascending order
+		static const vector<CharType> &foldable();
+	};
+	template<> char CharClass<char>::fold(char chr);
+	template<> bool CharClass<char>::isBoundary(char chr);
+	template<> const vector<char> &CharClass<char>::foldable();
+	template<> wchar_t CharClass<wchar_t>::fold(wchar_t chr);
+	template<> bool CharClass<wchar_t>::isBoundary(wchar_t chr);
+	template<> const vector<wchar_t> &CharClass<wchar_t>::foldable();
+
+	/*!
+	 * \brief Occurences of each term in a document. 'counts' is indexed by
+	 * termid, 'touched' lists the termids whose count isn't zero (in order of
+	 * first occurence) so that clearing only costs as much as filling.
+	 */
+	struct TermCounts {
+		vector<uint32_t> counts;
+		vector<uint32_t> touched;
+		TermCounts(size_t nterms = 0) : counts(nterms, 0) {}
+		inline void add(uint32_t termid, uint32_t n = 1) {
+			if (counts[termid] == 0)
+				touched.push_back(termid);
+			counts[termid] += n;
+		}
+		void clear() {
+			for (uint32_t termid : touched)
+				counts[termid] = 0;
+			touched.clear();
+		}
+	};
+
+	/*!
+	 * \brief Receives a matcher's matches as they are accepted, in input
+	 * order (see TermGrep::Matcher::setMatchSink()). Positions are
+	 * those of the input fed since the matcher's last reset(): the term's
+	 * first character, and the one past its last. In UTF-8 mode they are
+	 * byte offsets, like in the input, and not character counts, as is
+	 * Matcher::Match::startPos, which is one more since it counts the tab
+	 * that reset() feeds.
+	 */
+	class MatchSink {
+	public:
+		virtual ~MatchSink() {}
+		virtual void match(size_t termid, size_t startPos, size_t endPos) = 0;
+	};
+
+	struct MatchSpan {
+		size_t termid;
+		size_t startPos;
+		size_t endPos;
+	};
+
+	//! Keeps the matches, in a vector that clear() leaves allocated for reuse
+	struct SpanBuffer : public MatchSink {
+		vector<MatchSpan> spans;
+		void match(size_t termid, size_t startPos, size_t endPos) override {
+			spans.push_back(MatchSpan{termid, startPos, endPos});
+		}
+		void clear() { spans.clear(); }
+	};
+
+	/*!
+	 * \brief Read-only array that either owns its elements or views memory
+	 * owned elsewhere, such as a mapped file, so that compiled tables can be
+	 * used in place.
+	 */
+	template<class T>
+	class TableArray {
+	public:
+		TableArray() {}
+		TableArray(const TableArray &) = delete;
+		TableArray &operator=(vector<T> &&elems) {
+			owned = move(elems);
+			ptr = owned.data();
+			len = owned.size();
+			return *this;
+		}
+		void view(const T *elems, size_t size) {
+			owned.clear();
+			ptr = elems;
+			len = size;
+		}
+		inline const T &operator[](size_t i) const { return ptr[i]; }
+		const T *begin() const { return ptr; }
+		const T *end() const { return ptr + len; }
+		const T *data() const { return ptr; }
+		size_t size() const { return len; }
+	private:
+		vector<T> owned;
+		const T *ptr = nullptr;
+		size_t len = 0;
+	};
+
+	/*!
+	 * \brief How TermGrep::makeChecker() builds a matcher's automaton. They
+	 * all find the same matches:
+	 * - POWERSET determinizes the trie, which takes the most time and peak
+	 *   memory, for the fastest scan.
+	 * - AHO_CORASICK keeps the trie as it is, with failure links: about the
+	 *   size of the trie and quick to build, but each step may have to
+	 *   follow several links.
+	 * - AHO_CORASICK_DFA completes the trie's transitions along these links
+	 *   into a table like POWERSET's, without its sets of states.
+	 */
+	enum class MatcherEngine { POWERSET, AHO_CORASICK, AHO_CORASICK_DFA };
+
+	/*!
+	 * \brief Key identifying a compiled automaton saved with
+	 * TermGrep::Matcher::save(): a hash of the term list, the options it was
+	 * built with, the character type and the file format version.
+	 */
+	template<class CharType>
+	uint64_t automatonKey(const vector<basic_string<CharType>> &terms,
+		bool addWordBoundaries, bool utf8 = false,
+		MatcherEngine engine = MatcherEngine::POWERSET);
+
+	class Prefilter;
+	struct Utf8Chars;
+
 	template<class CharType = DefaultCharType>
 	class AbstractFSM {
 	public:
-		struct State;
-		struct NextState {
-			std::shared_ptr<struct State> state;
-			std::unique_ptr<struct NextState> next;
-		};
-		typedef struct State {
-			size_t id; // Corresponds to their position in the 'states' vector
+		static const uint32_t NO_EDGE = UINT32_MAX;
+		/*!
+		 * \brief A state, labelled with what the edges leading to it match:
+		 * a character, or a function of 'funcs'. States and edges are kept
+		 * in the 'states' and 'edges' arenas and refer to each other by
+		 * index, the root being state 0. The edges of a state are a list
+		 * linked through 'edges' in insertion order, and adding one to its
+		 * tail takes constant time.
+		 */
+		struct State {
 			CharType chr;
-			CheckFunc<CharType> func;
-			bool isfunc;
-			size_t termid = 0;
-			std::unique_ptr<struct NextState> next = std::unique_ptr<struct NextState>();
-			State(size_t id, CharType chr, CheckFunc<CharType> func,
-				bool isfunc, size_t termid, std::unique_ptr<struct NextState> next) :
-					id(id), chr(chr), func(func), isfunc(isfunc),
-					termid(termid), next(move(next)){};
-		} State;
-
-		typedef typename std::shared_ptr<State> StatePtr;
+			// 0 for a character, else 1 + the index of the function in 'funcs'
+			uint32_t func;
+			uint32_t termid;
+			uint32_t firstEdge;
+			uint32_t lastEdge;
+			bool isfunc() const { return func != 0; }
+		};
+		struct Edge {
+			uint32_t to;
+			uint32_t next;
+		};
 #ifndef TERMGREP_NO_GVPP
 		unique_ptr <gvpp::Graph<CharType>> getGraph();
 #endif
 		const strtype & getTerm(size_t id);
 		const vector<strtype> &getTerms() { return terms; }
+		//! Memory taken by the states and edges
+		size_t stateBytes() const {
+			return states.capacity() * sizeof(State) + edges.capacity() * sizeof(Edge);
+		}
+		/*!
+		 * \brief Frees the states and edges once they aren't needed anymore:
+		 * compiled matchers don't use them. They can't be drawn afterwards,
+		 * and a TermGrep can't add terms or build matchers anymore.
+		 */
+		void releaseStates();
 	protected:
 		AbstractFSM(vector<strtype> &terms) : terms(terms) {};
-		vector<StatePtr> states;
+		vector<State> states;
+		vector<Edge> edges;
+		vector<CheckFunc<CharType>> funcs;
 		const vector<strtype> &terms;
 
-		inline StatePtr getRoot() { return states[0]; }
 		size_t addState(CharType chr);
 		size_t addState(CheckFunc<CharType> func);
+		void addEdge(uint32_t from, uint32_t to);
+		bool matches(const State &st, CharType chr) const {
+			return st.isfunc() ? funcs[st.func - 1](chr) : st.chr == chr;
+		}
 	};
 
 	template<class CharType = DefaultCharType>
 	class TermGrep : public AbstractFSMT {
 	private:
-		typedef typename AbstractFSMT::StatePtr StatePtr;
 		bool addWordBoundaries;
+		bool utf8;
 		vector<strtype> _terms;
-		void addStates(StatePtr from, const CharType *chars);
-		StatePtr firstState;
+		// Indexed by termid: whether it was added with word boundaries, the
+		// trie state it ends on and whether it was removed since
+		vector<bool> termBounds;
+		vector<size_t> termNodes;
+		vector<bool> removedTerms;
+		// First term with a word boundary character in it, 0 if none
+		size_t boundaryCharTerm = 0;
+		// Number of terms removed so far
+		size_t removals = 0;
+		// Set when the trie has states of removed terms, or lacks the
+		// loaded ones, until rebuildTrie()
+		bool staleTrie = false;
+		void addStates(uint32_t from, const CharType *chars, size_t termid);
+		uint32_t addChild(uint32_t from, CharType chr);
+		size_t addMultibyte(uint32_t from, const CharType *chars, uint32_t &to);
+		// Throws once releaseStates() was called
+		void needTrie() const;
+		void rebuildTrie();
 		size_t longestTerm = 0;
+		double trieSeconds = 0;
 	public:
+		//! Figures about the trie, as terms are added
+		struct TrieStats {
+			double seconds = 0;
+			size_t states = 0;
+			size_t bytes = 0;
+		};
+		TrieStats getTrieStats() const {
+			TrieStats stats;
+			stats.seconds = trieSeconds;
+			stats.states = this->states.size();
+			stats.bytes = this->stateBytes();
+			return stats;
+		}
 		class Matcher : public AbstractFSMT {
 			friend class TermGrep<CharType>;
 		public:
+			/*!
+			 * \brief An accepted term. Its startPos counts the tab that
+			 * reset() feeds first, in the units of the input: bytes for
+			 * char, UTF-8 mode included, like a MatchSink's positions.
+			 */
 			class Match {
 				friend class TermGrep::Matcher;
 			private:
@@ -95,47 +281,462 @@ namespace termgrep {
 				const size_t startPos;
 				const strtype term;
 			};
+			//! Figures about the powerset construction of a matcher
+			struct BuildStats {
+				double seconds = 0;
+				//! Parts of 'seconds' taken by the powerset construction and
+				//! by the compilation (and minimization) of the table
+				double subsetSeconds = 0;
+				double compileSeconds = 0;
+				size_t states = 0;
+				size_t edges = 0;
+				//! Size of the compiled table, once equivalent states are merged
+				size_t minimizedStates = 0;
+				size_t minimizedEdges = 0;
+				//! Approximate peak memory used by the construction
+				size_t peakBytes = 0;
+			};
 		private:
+			/*!
+			 * Contiguous, index-based copy of the matcher's transitions, so
+			 * that a step costs one or two array loads instead of a walk
+			 * along the edge list. Rows are indexed by state id, the root
+			 * being 0: in a DFA, the ids left once minimizeRows() merged
+			 * equivalent states, which aren't those of 'states'; in an
+			 * Aho-Corasick table or a LazyTable's 'nfa', the trie's.
+			 *
+			 * Transitions are indexed by character class rather than by
+			 * character: every input character is mapped (case folding
+			 * included) to the class of the edge label it would match, or
+			 * to one of two shared classes for characters that appear in no
+			 * term, depending on whether they are word boundaries.
+			 *
+			 * Each state has a sorted sparse row (classes/targets between
+			 * rowStart[s] and rowStart[s+1]) and a word-boundary fallback
+			 * target (0 when it has no boundary edge). When the whole table
+			 * fits in MAX_DENSE_CELLS every state also gets a dense row of
+			 * nclasses targets, otherwise only the root and high fan-out
+			 * states do.
+			 *
+			 * An Aho-Corasick table (see Matcher(TermGrep &, MatcherEngine))
+			 * also has failure links: a state without an edge for a class
+			 * takes the one of the first state along its links that has it.
+			 */
+			struct Table {
+				enum : uint32_t {
+					NO_ROW = UINT32_MAX,
+					CLASS_OTHER = 0,
+					CLASS_BOUNDARY = 1,
+					LOW_CHARS = 256,
+					DENSE_FANOUT = 16,
+					MAX_DENSE_CELLS = 1 << 24
+				};
+				struct WideClass {
+					CharType chr;
+					uint32_t cls;
+					bool operator<(const WideClass &wc) const { return chr < wc.chr; }
+				};
+				uint32_t nclasses = 2;
+				TableArray<uint32_t> lowClass;
+				TableArray<WideClass> wideClass;
+				TableArray<uint8_t> classBoundary;
+				TableArray<uint32_t> rowStart;
+				TableArray<uint32_t> labels;
+				TableArray<uint32_t> targets;
+				TableArray<uint32_t> boundaryTarget;
+				TableArray<uint32_t> denseRow;
+				TableArray<uint32_t> dense;
+				TableArray<uint32_t> termids;
+				//! Failure links, empty but in Aho-Corasick tables
+				TableArray<uint32_t> fail;
+				//! Memory taken by the arrays, whether owned or mapped
+				size_t bytes() const;
+				/*!
+				 * \brief Whether the arrays are consistent, so that steps
+				 * stay within them and reach a state of a term < nterms:
+				 * for tables mapped from a file, which can't be trusted.
+				 */
+				bool valid(size_t nterms) const;
+				// Input is UTF-8, see Matcher::feedMultibyte()
+				bool utf8 = false;
+				// Keeps the file alive when the arrays above view a mapping
+				shared_ptr<const void> mapping;
+
+				typedef typename make_unsigned<CharType>::type UCharType;
+				uint32_t wideClassOf(CharType chr) const;
+				uint32_t sparseStep(uint32_t state, uint32_t cls, bool boundary) const;
+				uint32_t sparseStep(uint32_t state, uint32_t cls) const
+					{ return sparseStep(state, cls, classBoundary[cls]); }
+				inline uint32_t classOf(CharType chr) const {
+					if ((UCharType) chr < LOW_CHARS)
+						return lowClass[(UCharType) chr];
+					return wideClassOf(chr);
+				}
+				inline uint32_t step(uint32_t state, uint32_t cls) const {
+					uint32_t row = denseRow[state];
+					if (row != NO_ROW)
+						return dense[row * nclasses + cls];
+					return sparseStep(state, cls);
+				}
+			};
+			/*!
+			 * Automaton determinized while scanning, for term lists whose
+			 * full powerset doesn't fit in memory (see makeLazyChecker()).
+			 * Its states are sets of trie states, stepped with the trie's
+			 * own table ('nfa', shared between copies) the first time they
+			 * are taken, then through their dense row of nclasses targets.
+			 *
+			 * Each copy caches states and rows up to maxBytes. Once over
+			 * it, the cache is flushed but for the root and the current
+			 * state. When flushes come before the states could be reused
+			 * much, the cache is bypassed for the rest of the document:
+			 * each step then computes the next set in SCRATCH, which is
+			 * slower but takes no memory.
+			 *
+			 * Flushes wait for the end of multibyte UTF-8 characters, whose
+			 * first state must stay valid until then (see keep()).
+			 */
+			struct LazyTable {
+				enum : uint32_t {
+					UNKNOWN = UINT32_MAX,
+					SCRATCH = 1,
+					// In bypass mode, the set a multibyte character started on
+					KEPT = 2,
+					// Characters per cached state under which a flush
+					// means the cache thrashes
+					THRASH_CHARS = 16
+				};
+				struct SetHash {
+					size_t operator()(const vector<uint32_t> &ids) const;
+				};
+				shared_ptr<const Table> nfa;
+				const size_t maxBytes;
+				const uint32_t nclasses;
+				// Interned sets, pointing to the keys of 'interned'
+				vector<const vector<uint32_t> *> sets;
+				unordered_map<vector<uint32_t>, uint32_t, SetHash> interned;
+				vector<uint32_t> termids;
+				vector<uint32_t> rows;
+				vector<uint32_t> scratch, kept, next;
+				bool bypass = false;
+				size_t bytes = 0;
+				// Characters scanned since the last flush: in previous
+				// documents, then in this one from flushPos
+				size_t sinceFlush = 0, flushPos = 0;
+				size_t flushes = 0;
+				// Positions spanned by each term, see termLength()
+				vector<size_t> termLengths;
+
+				LazyTable(shared_ptr<const Table> nfa, size_t maxBytes,
+					const vector<strtype> &terms);
+				inline uint32_t step(uint32_t state, uint32_t cls) {
+					uint32_t to = rows[(size_t) state * nclasses + cls];
+					return to != UNKNOWN ? to : miss(state, cls);
+				}
+				uint32_t miss(uint32_t state, uint32_t cls);
+				//! Id under which 'state' can still be stepped from after
+				//! the next steps: only SCRATCH has to be copied, to KEPT
+				uint32_t keep(uint32_t state);
+				//! State of 'set', as the current state
+				uint32_t adopt(const vector<uint32_t> &set);
+				inline bool full() const
+					{ return bytes + rows.capacity() * sizeof(uint32_t) > maxBytes; }
+				//! Empties the cache but for the root and 'keep', returns its new id
+				uint32_t flush(uint32_t keep, size_t curPos);
+				//! At the end of a document: leaves bypass mode
+				void restart(size_t endPos);
+			private:
+				void clear();
+				uint32_t intern(const vector<uint32_t> &set);
+				uint32_t longestTerm(const vector<uint32_t> &set) const;
+			};
 			TermGrep &grep;
 			Matcher(TermGrep &grep);
-			StatePtr curstate;
-			list<Match> candidates;
+			Matcher(TermGrep &grep, shared_ptr<const Table> table);
+			Matcher(TermGrep &grep, size_t lazyBytes);
+			Matcher(TermGrep &grep, MatcherEngine engine);
+			void compile();
+			static void addDenseRows(Table &table, bool all);
+			static void buildRows(Table &table,
+				const vector<typename AbstractFSMT::State> &states,
+				const vector<typename AbstractFSMT::Edge> &edges, bool utf8,
+				vector<uint32_t> &rowStart, vector<uint32_t> &labels,
+				vector<uint32_t> &targets, vector<uint32_t> &boundaryTarget,
+				vector<uint32_t> &termids);
+			// Shared between copies, which only duplicate the scanning state
+			shared_ptr<const Table> table;
+			uint32_t curstate;
+			/*!
+			 * Terms added and removed since the table was compiled, as set
+			 * by TermGrep::updateChecker(). The added ones get an automaton
+			 * of their own, stepped alongside the table: at each position,
+			 * the longest term either of them ends counts. A removed term
+			 * counts for remap[termid] instead, the longest of its suffixes
+			 * that wasn't removed (0 if none), which is what a table
+			 * compiled without it would find there.
+			 */
+			struct Overlay {
+				shared_ptr<const Table> added;
+				//! termids of the added automaton -> termids of the TermGrep
+				vector<uint32_t> addedTermids;
+				//! Empty if no term of the table was removed
+				vector<uint32_t> remap;
+			};
+			shared_ptr<const Overlay> overlay;
+			const Table *added = nullptr;
+			uint32_t addedState = 0;
+			// Number of terms (#ERROR# included) the table was compiled with
+			size_t compiledTerms = 0;
+			// TermGrep::removals when the table was compiled
+			size_t compiledRemovals = 0;
+			size_t overlaid(size_t termid) const;
+			size_t suffixTermid(size_t termid) const;
+			/*!
+			 * Skips the input that can't lead out of the root (see
+			 * prefilter.hpp), shared between copies. It is made from the
+			 * table and the overlay, and left out when it wouldn't skip
+			 * much of a typical text.
+			 */
+			shared_ptr<const Prefilter> prefilter;
+			bool usePrefilter = true;
+			static const size_t PREFILTER_MIN_SKIP = 8, PREFILTER_BACKOFF = 128;
+			void makePrefilter();
+			// When set, 'table' is the trie's, see LazyTable
+			unique_ptr<LazyTable> lazy;
+			inline void step(CharType chr) {
+				if (lazy) {
+					curstate = lazy->step(curstate, table->classOf(chr));
+					if (lazy->full() && charCode == 0)
+						curstate = lazy->flush(curstate, curPos);
+				} else
+					curstate = table->step(curstate, table->classOf(chr));
+				if (added)
+					addedState = added->step(addedState, added->classOf(chr));
+			}
+			/*!
+			 * Matches that a longer, overlapping one could still replace.
+			 * A new candidate evicts the ones starting at or after it, so
+			 * they are always sorted by startPos, and they are accepted
+			 * once longestTerm characters old: they live in a ring buffer
+			 * of at least longestTerm + 2 slots, from candHead to candTail.
+			 */
+			struct Candidate {
+				size_t termid;
+				size_t startPos;
+				// The Match::startPos of the candidate, see advance()
+				size_t matchPos;
+				// What sinkMatch() reports, only set when there is a sink
+				size_t spanStart, spanEnd;
+			};
+			vector<Candidate> candidates;
+			size_t candMask = 0, candHead = 0, candTail = 0;
+			// Sizes the candidate ring and the per-term counters
+			void initBuffers();
+			inline void accept(const Candidate &cand) {
+				counts.add(cand.termid);
+				if (sink)
+					sinkMatch(cand);
+				if (keepMatches)
+					matches.push_back(Match(cand.termid, cand.matchPos,
+						this->getTerm(cand.termid)));
+			}
+			void clearResults() { matches.clear(); counts.clear(); }
 			list<Match> matches;
+			TermCounts counts;
+			bool keepMatches = true;
+			MatchSink *sink = nullptr;
+			// Where a chunk helper's matches wait for feedParallel()
+			SpanBuffer chunkSpans;
+			// Position past the input, once end() knows it
+			size_t inputEnd = SIZE_MAX;
+			void setSpan(Candidate &cand) const;
+			void sinkMatch(const Candidate &cand) {
+				sink->match(cand.termid, cand.spanStart, cand.spanEnd);
+			}
 			size_t curPos = 0;
-			size_t longestTerm = 0, nextCheck = 0;
+			size_t longestTerm = 0;
+			// Lowest startPos of the candidates seen, for feedParallel()
+			size_t earliestStart = SIZE_MAX;
+			/*!
+			 * In UTF-8 mode ('utf8Chars' set), the bytes of a multibyte
+			 * character are stepped as they come, along the paths of the
+			 * characters of the terms, and through Utf8Chars, whose state
+			 * is 'charCode' until the character is complete. It is then
+			 * stepped again from the states it started on if it didn't
+			 * complete a path, or has a lowercase form, see endChar().
+			 */
+			const Utf8Chars *utf8Chars = nullptr;
+			uint32_t charCode = 0, charState = 0, charAdded = 0;
+			/*!
+			 * The bytes of the input past one per position: the byte offset
+			 * of position pos is pos - 1 plus the extra bytes of the
+			 * characters before it. The last multibyte characters are kept
+			 * in a ring as big as the candidates', with the extra bytes up
+			 * to theirs included, 'floorExtra' being those before the ring.
+			 */
+			size_t extraBytes = 0, floorExtra = 0;
+			struct CharBytes {
+				size_t pos;
+				size_t extra;
+			};
+			vector<CharBytes> charBytes;
+			size_t charBytesCount = 0;
+			size_t byteOffset(size_t pos) const;
+			void feedMultibyte(CharType chr);
+			void endChar();
+			void abandonChar();
+			// Moves on to the next position, once curstate has been stepped
+			void advance();
+			// Positions spanned by each term, see termLength(), and whether
+			// it is surrounded by word boundaries
+			vector<uint32_t> termLengths;
+			vector<uint8_t> termBounded;
+			// curPos of a chunk helper when it starts on its chunk
+			size_t chunkStart = 0;
+			vector<unique_ptr<Matcher>> chunkMatchers;
+			BuildStats buildStats;
 		public:
+			/*!
+			 * \brief Makes a new, reset matcher sharing the compiled
+			 * automaton of 'other'. Copies can be used from other threads,
+			 * and don't have the states 'other' was compiled from.
+			 */
+			Matcher(const Matcher &other);
 			void reset();
 			void end();
 			void feed(CharType c);
 			void feed(const CharType *chrs, size_t n);
+			/*!
+			 * \brief Same as feed(chrs, n), but the input is split into
+			 * chunks scanned concurrently by up to 'nthreads' threads.
+			 * Each chunk is scanned from the root after a warm-up over the
+			 * preceding longestTerm characters, and results are stitched
+			 * back in order. A chunk whose starting state turns out to
+			 * differ from the one a sequential scan would reach is scanned
+			 * again, so the matches are always identical to feed()'s.
+			 */
+			void feedParallel(const CharType *chrs, size_t n, size_t nthreads);
 			void feed(strtype str) { feed(str.c_str()); }
 			void check(strtype str) { reset(); feed(str); end(); }
+			/*!
+			 * \brief When false, accepted matches are only counted (see
+			 * getCounts()) and getMatches() stays empty, which saves an
+			 * allocation and a term copy per match.
+			 */
+			void setKeepMatches(bool keep) { keepMatches = keep; }
+			/*!
+			 * \brief Passes every accepted match to 'sink' (none if nullptr)
+			 * as it is accepted, with its end position and without copying
+			 * its term. It is set before feeding a document, as it only gets
+			 * the matches found afterwards. Copies of the matcher don't
+			 * inherit it.
+			 */
+			void setMatchSink(MatchSink *sink) { this->sink = sink; }
+			/*!
+			 * \brief Whether feed(chrs, n) jumps over the input where no term
+			 * can start, on by default. Matches are the same either way.
+			 */
+			void setPrefilter(bool use) { usePrefilter = use; }
+			//! Implementation of the prefilter in use, nullptr if none
+			const char *getPrefilterName() const;
 			const list<Match> &getMatches() { return matches; }
+			const TermCounts &getCounts() const { return counts; }
+			const BuildStats &getBuildStats() const { return buildStats; }
+			//! Size of the compiled automaton, shared by the copies, and
+			//! of the states a lazy one cached
+			size_t getTableBytes() const
+				{ return table->bytes() + (lazy ? lazy->bytes : 0); }
+			/*!
+			 * \brief Writes the compiled automaton and the term list to
+			 * 'path', so that TermGrep::loadChecker() can map it back
+			 * without rebuilding anything. 'key' should come from
+			 * automatonKey(). Throws a runtime_error if the file can't be
+			 * written, or if terms were added or removed since the matcher
+			 * was compiled.
+			 */
+			void save(const string &path, uint64_t key) const;
 			map<size_t, size_t> getTermidOccurences();
 			map<size_t, size_t> &getTermidOccurences(map<size_t, size_t> &occurences);
 			map<strtype, size_t> getTermOccurences();
 			map<strtype, size_t> &getTermOccurences(map<strtype, size_t> &occurences);
-			void clearMatches() { matches.clear(); }
+			void clearMatches() { clearResults(); }
 		};
-		TermGrep(bool addWordBoundaries = true) :
-				AbstractFSMT(_terms), addWordBoundaries(addWordBoundaries) {
+		/*!
+		 * \brief 'utf8' (only for char) makes the matcher handle terms
+		 * and inputs as UTF-8: non-ASCII characters are then folded and
+		 * classified as word boundaries like wchar_t ones, while still
+		 * being matched byte by byte. Positions remain those of the
+		 * bytes, both in Matcher::Match and for a MatchSink.
+		 */
+		TermGrep(bool addWordBoundaries = true, bool utf8 = false) :
+				AbstractFSMT(_terms), addWordBoundaries(addWordBoundaries),
+				utf8(utf8 && sizeof(CharType) == 1) {
 			this->addState((CharType)0);
 			_terms.push_back(CWSTR(CharType, "#ERROR#"));
+			termBounds.push_back(false);
+			termNodes.push_back(0);
+			removedTerms.push_back(false);
 		}
 		size_t addTerm(strtype term) { return addTerm(term, addWordBoundaries); }
 		size_t addTerm(strtype term, bool bound);
 
-		unique_ptr <Matcher> makeChecker();
+		/*!
+		 * \brief Removes a term: its termid stays reserved, but it doesn't
+		 * match anymore in the matchers built or updated afterwards, which
+		 * find what they would have if it had never been added.
+		 * Returns false if there is no such term, or it was removed already.
+		 */
+		bool removeTerm(size_t termid);
+		bool isRemoved(size_t termid) const { return removedTerms[termid]; }
+
+		unique_ptr <Matcher> makeChecker(MatcherEngine engine = MatcherEngine::POWERSET);
+		/*!
+		 * \brief Makes a matcher that determinizes the automaton while it
+		 * scans instead of upfront, caching at most about 'cacheBytes' of
+		 * it per copy (see Matcher::LazyTable). Building it only costs a
+		 * copy of the trie, and it finds the same matches as makeChecker()'s,
+		 * but scans slower until its cache is warm, and all the way through
+		 * if the states a document visits don't fit in the cache. It can't
+		 * be saved.
+		 */
+		unique_ptr <Matcher> makeLazyChecker(size_t cacheBytes);
+		/*!
+		 * \brief Brings 'matcher' up to date with the terms added and
+		 * removed since its table was compiled (or loaded), without
+		 * compiling it again: only the added terms are, into an automaton
+		 * scanned alongside it (see Matcher::Overlay). This costs as much as
+		 * building a matcher for the added terms alone, so it is meant for
+		 * small changes to a large term list; makeChecker() folds them into
+		 * a single table again. Copies of 'matcher' made afterwards share
+		 * the update, which also resets it.
+		 *
+		 * Matches are those of a rebuilt matcher. In a single table, the
+		 * edge of a word boundary character (like the spaces of multi-word
+		 * terms) hides the word boundary edges of the other terms at the
+		 * same place, which it can't do across automata: when an added
+		 * term has such characters, or the table has some and terms were
+		 * removed or added with word boundaries, all the terms are
+		 * compiled again instead, like makeChecker() would.
+		 */
+		void updateChecker(Matcher &matcher);
+		/*!
+		 * \brief Maps a matcher saved by Matcher::save() and loads its term
+		 * list into this TermGrep, which must not have any terms yet.
+		 * Returns nullptr if the file doesn't exist, isn't a saved
+		 * automaton for this character type or wasn't saved with 'key'.
+		 * The loaded matcher has no states to draw: only its table.
+		 */
+		unique_ptr <Matcher> loadChecker(const string &path, uint64_t key);
 	};
 
 	template<class CharType = DefaultCharType>
 	basic_istream<CharType> &operator>>(basic_istream<CharType> &is,
 		typename TermGrep<CharType>::Matcher &checker) {
-		static const size_t BUFSIZE = 256;
-		CharType buf[BUFSIZE];
+		static const size_t BUFSIZE = 1 << 16;
+		vector<CharType> buf(BUFSIZE);
 		while (is) {
-			is.read(buf, BUFSIZE);
-			checker.feed(buf, is.gcount());
+			is.read(buf.data(), BUFSIZE);
+			checker.feed(buf.data(), is.gcount());
 		}
 		return is;
 	}
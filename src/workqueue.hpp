@@ -0,0 +1,91 @@
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+
+namespace termgrep {
+
+    /*!
+     * \brief Hands out the indices [0, count) to a fixed number of workers.
+     * Indices are dealt round-robin in blocks of consecutive indices, so the
+     * work roughly proceeds in input order. A worker whose own deque runs
+     * dry steals from the back of the fullest one, so a few long jobs don't
+     * keep the others waiting.
+     */
+    class WorkStealingQueue {
+    public:
+        WorkStealingQueue(size_t count, size_t workers, size_t blockSize = 4) {
+            for (size_t i = 0; i < workers; i ++)
+                deques.emplace_back(new Deque());
+            for (size_t i = 0; i < count; i ++)
+                deques[(i / blockSize) % workers]->indices.push_back(i);
+        }
+
+        //! Returns false once there is no work left for anyone
+        bool next(size_t worker, size_t &index) {
+            {
+                Deque &own = *deques[worker];
+                std::lock_guard<std::mutex> guard(own.lock);
+                if (!own.indices.empty()) {
+                    index = own.indices.front();
+                    own.indices.pop_front();
+                    return true;
+                }
+            }
+            while (true) {
+                Deque *victim = nullptr;
+                size_t most = 0;
+                for (auto &dq : deques) {
+                    std::lock_guard<std::mutex> guard(dq->lock);
+                    if (dq->indices.size() > most) {
+                        most = dq->indices.size();
+                        victim = dq.get();
+                    }
+                }
+                if (victim == nullptr)
+                    return false;
+                std::lock_guard<std::mutex> guard(victim->lock);
+                if (!victim->indices.empty()) { // Might have been emptied since
+                    index = victim->indices.back();
+                    victim->indices.pop_back();
+                    return true;
+                }
+            }
+        }
+    private:
+        struct Deque {
+            std::mutex lock;
+            std::deque<size_t> indices;
+        };
+        std::vector<std::unique_ptr<Deque>> deques;
+    };
+
+    /*!
+     * \brief Collects results that complete out of order and passes them on
+     * to 'emit' in index order, as soon as all the previous ones are in.
+     * 'emit' is called with the buffer's lock held.
+     */
+    template<class T>
+    class ReorderBuffer {
+    public:
+        ReorderBuffer(std::function<void(size_t, T &)> emit) : emit(emit) {}
+
+        void push(size_t index, T result) {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.insert(std::make_pair(index, std::move(result)));
+            auto it = pending.begin();
+            while (it != pending.end() && it->first == nextIndex) {
+                emit(it->first, it->second);
+                it = pending.erase(it);
+                nextIndex ++;
+            }
+        }
+    private:
+        std::function<void(size_t, T &)> emit;
+        std::mutex lock;
+        std::map<size_t, T> pending;
+        size_t nextIndex = 0;
+    };
+}